@@ -0,0 +1,113 @@
+// Measures the blend kernels the CPU backend (-B cpu) composites with.
+//
+// Every kernel blends a 1920 pixel row (one scanline of a 1080p window) over another,
+// for the cases paint_client runs into: an ARGB window, a depth 24 window with _NET_WM_WINDOW_OPACITY set,
+// and an ARGB window that also has an opacity.
+// Before timing anything, every kernel is checked against the plain C++ one, they have to match exactly:
+// on every width up to a few vectors (so the leftover pixels go through the smaller kernels),
+// starting at every offset, and on pixels that aren't premultiplied, where the channels overflow.
+//
+// Output is one line per kernel and case:
+//     kernel=<name> case=<name> mpixels_per_second=<n>
+//
+
+#include "blend.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+const int row_width = 1920;
+
+struct Kernel {
+    const char *name;
+    Blend_Over_Function blend;
+};
+
+struct Case {
+    const char *name;
+    int opacity;
+    bool opaque_source;
+};
+
+// Random premultiplied pixels, with a good share of fully opaque and fully transparent ones.
+// Not premultiplied, the color channels can be anything, which a broken client can send us.
+static std::vector<uint32_t> random_pixels(std::mt19937 &random, int count, bool premultiplied = true) {
+    std::vector<uint32_t> pixels(count);
+    for (uint32_t &pixel : pixels) {
+        uint32_t alpha = random() % 3 == 0 ? 255 : random() % 3 == 0 ? 0 : random() % 256;
+        uint32_t limit = premultiplied ? alpha + 1 : 256;
+        uint32_t r = random() % limit;
+        uint32_t g = random() % limit;
+        uint32_t b = random() % limit;
+        pixel = alpha << 24 | r << 16 | g << 8 | b;
+    }
+    return pixels;
+}
+
+// Whether every kernel gives what the scalar one does for count pixels starting at first
+static bool kernels_match(const std::vector<Kernel> &kernels, const Case &test, const char *input,
+                          const std::vector<uint32_t> &source, const std::vector<uint32_t> &background,
+                          int first, int count) {
+    std::vector<uint32_t> expected = background;
+    blend_over_scalar(expected.data() + first, source.data() + first, count, test.opacity, test.opaque_source);
+    bool match = true;
+    for (const Kernel &kernel : kernels) {
+        std::vector<uint32_t> result = background;
+        kernel.blend(result.data() + first, source.data() + first, count, test.opacity, test.opaque_source);
+        if (memcmp(result.data(), expected.data(), background.size() * 4) != 0) {
+            fprintf(stderr, "kernel %s doesn't match scalar for %s on %s pixels, %d at %d\n",
+                    kernel.name, test.name, input, count, first);
+            match = false;
+        }
+    }
+    return match;
+}
+
+int main() {
+    std::vector<Kernel> kernels = {{"scalar", blend_over_scalar}};
+#ifdef BLEND_HAVE_X86
+    kernels.push_back({"sse2", blend_over_sse2});
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", blend_over_avx2});
+#endif
+    const Case cases[] = {{"argb", 255, false}, {"opacity", 180, true}, {"argb_opacity", 180, false}};
+
+    std::mt19937 random(1);
+    std::vector<uint32_t> source = random_pixels(random, row_width);
+    std::vector<uint32_t> background = random_pixels(random, row_width);
+
+    std::vector<uint32_t> bad_source = random_pixels(random, row_width, false);
+    std::vector<uint32_t> bad_background = random_pixels(random, row_width, false);
+
+    bool mismatch = false;
+    for (const Case &test : cases) {
+        mismatch |= !kernels_match(kernels, test, "premultiplied", source, background, 0, row_width);
+        mismatch |= !kernels_match(kernels, test, "not premultiplied", bad_source, bad_background, 0, row_width);
+        for (int first = 0; first < 8; first++) {
+            for (int count = 0; count <= 40; count++) {
+                mismatch |= !kernels_match(kernels, test, "premultiplied", source, background, first, count);
+                mismatch |= !kernels_match(kernels, test, "not premultiplied", bad_source, bad_background,
+                                           first, count);
+            }
+        }
+    }
+    if (mismatch)
+        return 1;
+
+    const int rounds = 20000;
+    for (const Case &test : cases) {
+        for (const Kernel &kernel : kernels) {
+            std::vector<uint32_t> destination = background;
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds; round++)
+                kernel.blend(destination.data(), source.data(), row_width, test.opacity, test.opaque_source);
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            printf("kernel=%s case=%s mpixels_per_second=%.0f\n",
+                   kernel.name, test.name, (double) rounds * row_width / elapsed.count());
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Measures how much a single window event costs Client_Stack as the number of windows grows.
+//
+// Every event handler in the compositor looks up the client the event is for,
+// and ConfigureNotify/CirculateNotify additionally move it somewhere else in the stacking order.
+// We do exactly that here with random windows, so the numbers printed should stay flat
+// going from 10 to 10,000 windows.
+//
+// Output is one line per window count:
+//     windows=<n> lookup_ns=<ns per lookup> restack_ns=<ns per lookup + restack>
+//
+
+#include "client_stack.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+
+static double nanoseconds_since(std::chrono::steady_clock::time_point start, int iterations) {
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main() {
+    const int window_counts[] = {10, 100, 1000, 10000};
+    const int iterations = 1000000;
+
+    for (int window_count : window_counts) {
+        std::vector<Client> storage(window_count);
+        std::vector<Window> windows(window_count);
+        Client_Stack stack;
+        std::mt19937 random(window_count);
+
+        for (int i = 0; i < window_count; i++) {
+            // X hands out window ids with the client's resource base in the high bits
+            windows[i] = 0x1000000 + (random() & 0xffffff);
+            storage[i] = Client();
+            storage[i].window = windows[i];
+            if (stack.find(windows[i]))
+                continue;
+            stack.push_top(&storage[i]);
+        }
+
+        std::vector<int> picks(iterations);
+        for (int &pick : picks)
+            pick = random() % window_count;
+
+        unsigned long found = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            found += stack.find(windows[picks[i]]) != nullptr;
+        double lookup_ns = nanoseconds_since(start, iterations);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            Client *client = stack.find(windows[picks[i]]);
+            Window sibling = windows[picks[(i + 1) % iterations]];
+            if (!client)
+                continue;
+            switch (i % 4) {
+                case 0:
+                    stack.move_to_top(client);
+                    break;
+                case 1:
+                    stack.move_to_bottom(client);
+                    break;
+                default:
+                    stack.place_above(client, sibling);
+                    break;
+            }
+        }
+        double restack_ns = nanoseconds_since(start, iterations);
+
+        printf("windows=%d lookup_ns=%.1f restack_ns=%.1f found=%lu\n",
+               window_count, lookup_ns, restack_ns, found);
+    }
+    return 0;
+}
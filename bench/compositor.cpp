@@ -0,0 +1,556 @@
+// Runs the compositor on a headless Xvfb server and measures it under scripted workloads.
+//
+// For every workload we start a fresh Xvfb, start the compositor on it with -s (statistics),
+// create the windows, and then keep poking at them for a few seconds:
+//     damage   - N windows, random rectangles drawn into random windows at a set rate
+//     drag     - N windows, one of them moved around like it's being dragged (ConfigureNotify storm)
+//     restack  - N windows, random windows raised (restacking storm)
+//     argb     - like damage, but the windows have an alpha channel
+//     shaped   - like damage, but the windows are shaped
+//     startup  - N small windows exist before the compositor starts, measures how long it takes to pick them up
+//                and the longest the display stops answering meanwhile (the server grab), try it with -n 5000
+//     replay   - only with -f, plays an event record (xcompmgr-simple -E) at the recorded speed
+//                with xcompmgr-simple-replay, on a screen the size of the recorded one
+//
+// Latency is measured from the moment a rectangle is drawn (or a window moved) until the compositor
+// draws to the root window, which we see through a Damage object on the root.
+// Since the windows are redirected, drawing into them never damages the root itself.
+//
+// Results are printed as one JSON object per line, so runs can be compared across commits:
+//     {"workload":"damage","windows":100,"seconds":5,"frames":300,"cpu_ms_per_frame":0.21,
+//      "requests_per_frame":42.0,"round_trips_per_frame":0.0,"latency_us":{"p50":...,"p90":...,"p99":...,"max":...}}
+//
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/shape.h>
+
+#include "event_record.h"
+
+#ifndef COMPOSITOR_PATH
+#define COMPOSITOR_PATH "./xcompmgr-simple"
+#endif
+#ifndef REPLAY_PATH
+#define REPLAY_PATH "./xcompmgr-simple-replay"
+#endif
+
+struct Options {
+    const char *compositor = COMPOSITOR_PATH;
+    const char *workload = "all";
+    const char *backend = "xrender"; // passed to the compositor's -B
+    bool paint_thread = false; // run the compositor with -p
+    bool present = false; // run the compositor with -P
+    const char *record = nullptr; // -f, the event record the replay workload plays
+    int windows = 100;
+    int seconds = 5;
+    int rate = 1000; // damage rectangles, moves, or raises per second
+    int width = 1920;
+    int height = 1080;
+};
+
+struct Result {
+    unsigned long frames = 0;
+    double requests = 0;
+    double round_trips = 0;
+    double cpu_ms = 0;
+    std::vector<uint64_t> latencies_us;
+
+    // startup workload
+    uint64_t startup_us = 0; // as reported by the compositor, from main until the first frame was sent
+    uint64_t grab_us = 0;
+    uint64_t ready_us = 0; // from starting the compositor until it reported being done
+    uint64_t max_stall_us = 0; // the longest round trip another client saw meanwhile
+};
+
+static uint64_t monotonic_us() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+    timespec duration;
+    duration.tv_sec = us / 1000000;
+    duration.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&duration, nullptr);
+}
+
+// Finds a display number nobody is using yet
+static int free_display_number() {
+    for (int number = 90; number < 200; number++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/.X11-unix/X%d", number);
+        struct stat info;
+        if (stat(path, &info) != 0)
+            return number;
+    }
+    fprintf(stderr, "No free display number\n");
+    exit(1);
+}
+
+static pid_t start_xvfb(const Options &options, const char *display_name) {
+    char screen[64];
+    snprintf(screen, sizeof(screen), "%dx%dx24", options.width, options.height);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO);
+        execlp("Xvfb", "Xvfb", display_name, "-screen", "0", screen, "-nolisten", "tcp", nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Starts the compositor with its statistics going into a pipe we can read from
+static pid_t start_compositor(const Options &options, const char *display_name, int *stats_fd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("DISPLAY", display_name, 1);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        std::vector<const char *> arguments = {options.compositor, "-s", "-B", options.backend};
+        if (options.paint_thread)
+            arguments.push_back("-p");
+        if (options.present)
+            arguments.push_back("-P");
+        arguments.push_back(nullptr);
+        execv(options.compositor, (char **) arguments.data());
+        perror(options.compositor);
+        _exit(127);
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    *stats_fd = fds[0];
+    return pid;
+}
+
+static void stop(pid_t pid) {
+    if (pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+static Display *connect_when_ready(const char *display_name) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        Display *display = XOpenDisplay(display_name);
+        if (display)
+            return display;
+        sleep_us(50000);
+    }
+    fprintf(stderr, "Xvfb didn't come up on %s\n", display_name);
+    exit(1);
+}
+
+static bool wait_for_compositor(Display *display) {
+    char name[32];
+    snprintf(name, sizeof(name), "_NET_WM_CM_S%d", DefaultScreen(display));
+    Atom selection = XInternAtom(display, name, false);
+    for (int attempt = 0; attempt < 100; attempt++) {
+        if (XGetSelectionOwner(display, selection))
+            return true;
+        sleep_us(50000);
+    }
+    return false;
+}
+
+// Reads whatever statistics lines the compositor printed since the last call
+static void read_statistics(int fd, std::string &pending, Result &result) {
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+        pending.append(buffer, count);
+
+    size_t end;
+    while ((end = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        unsigned long frames = 0;
+        double requests_per_frame = 0;
+        double round_trips_per_frame = 0;
+        unsigned long long startup_us = 0;
+        unsigned long long grab_us = 0;
+        if (sscanf(line.c_str(), "startup_us=%llu grab_us=%llu", &startup_us, &grab_us) == 2) {
+            result.startup_us = startup_us;
+            result.grab_us = grab_us;
+        } else if (sscanf(line.c_str(), "frames=%lu requests_per_frame=%lf round_trips_per_frame=%lf",
+                   &frames, &requests_per_frame, &round_trips_per_frame) == 3) {
+            result.frames += frames;
+            result.requests += frames * requests_per_frame;
+            result.round_trips += frames * round_trips_per_frame;
+        }
+    }
+}
+
+// utime + stime of the process in milliseconds
+static double cpu_time_ms(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+    char line[1024];
+    double ms = 0;
+    if (fgets(line, sizeof(line), file)) {
+        // The process name can have spaces in it, so we start after the closing parenthesis
+        const char *fields = strrchr(line, ')');
+        unsigned long user_ticks = 0;
+        unsigned long system_ticks = 0;
+        if (fields && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                             &user_ticks, &system_ticks) == 2)
+            ms = (user_ticks + system_ticks) * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+    fclose(file);
+    return ms;
+}
+
+struct Workload_Windows {
+    std::vector<Window> windows;
+    GC gc = nullptr;
+};
+
+static Window create_window(Display *display, const Options &options, bool argb, bool shaped) {
+    int x = rand() % (options.width - 200);
+    int y = rand() % (options.height - 200);
+    int width = 100 + rand() % 500;
+    int height = 100 + rand() % 400;
+    Window root = DefaultRootWindow(display);
+    Window window;
+
+    XVisualInfo info;
+    if (argb && XMatchVisualInfo(display, DefaultScreen(display), 32, TrueColor, &info)) {
+        XSetWindowAttributes attributes;
+        attributes.colormap = XCreateColormap(display, root, info.visual, AllocNone);
+        attributes.border_pixel = 0;
+        attributes.background_pixel = 0x80808080;
+        window = XCreateWindow(display, root, x, y, width, height, 0, 32, InputOutput, info.visual,
+                               CWColormap | CWBorderPixel | CWBackPixel, &attributes);
+    } else {
+        window = XCreateSimpleWindow(display, root, x, y, width, height, 0, 0, 0x404040);
+    }
+
+    if (shaped) {
+        XRectangle parts[2];
+        parts[0].x = 0;
+        parts[0].y = 0;
+        parts[0].width = width;
+        parts[0].height = height / 2;
+        parts[1].x = width / 4;
+        parts[1].y = height / 2;
+        parts[1].width = width / 2;
+        parts[1].height = height / 2;
+        XShapeCombineRectangles(display, window, ShapeBounding, 0, 0, parts, 2, ShapeSet, Unsorted);
+    }
+
+    XMapWindow(display, window);
+    return window;
+}
+
+static Result run_workload(const Options &options, const std::string &workload) {
+    char display_name[16];
+    snprintf(display_name, sizeof(display_name), ":%d", free_display_number());
+
+    pid_t xvfb = start_xvfb(options, display_name);
+    Display *display = connect_when_ready(display_name);
+
+    int stats_fd;
+    pid_t compositor = start_compositor(options, display_name, &stats_fd);
+    Result result;
+    if (!wait_for_compositor(display)) {
+        fprintf(stderr, "The compositor didn't start\n");
+        stop(compositor);
+        stop(xvfb);
+        exit(1);
+    }
+
+    int damage_event, damage_error;
+    XDamageQueryExtension(display, &damage_event, &damage_error);
+    Window root = DefaultRootWindow(display);
+    Damage root_damage = XDamageCreate(display, root, XDamageReportNonEmpty);
+
+    srand(1);
+    bool argb = workload == "argb";
+    bool shaped = workload == "shaped";
+    Workload_Windows state;
+    for (int i = 0; i < options.windows; i++)
+        state.windows.push_back(create_window(display, options, argb, shaped));
+    state.gc = XCreateGC(display, state.windows[0], 0, nullptr);
+    XSync(display, false);
+    sleep_us(500000); // let the compositor settle after all the maps
+
+    std::string pending;
+    read_statistics(stats_fd, pending, result); // throw away what happened during setup
+    result = Result();
+    double cpu_start = cpu_time_ms(compositor);
+
+    std::vector<uint64_t> waiting; // when each change we haven't seen presented yet was made
+    uint64_t interval = 1000000 / options.rate;
+    uint64_t start = monotonic_us();
+    uint64_t next_action = start;
+    int drag_x = 0;
+    while (monotonic_us() - start < (uint64_t) options.seconds * 1000000) {
+        uint64_t now = monotonic_us();
+        if (now >= next_action) {
+            Window window = state.windows[rand() % state.windows.size()];
+            if (workload == "drag") {
+                drag_x = (drag_x + 7) % (options.width - 600);
+                XMoveWindow(display, state.windows[0], drag_x, 100 + drag_x % 300);
+            } else if (workload == "restack") {
+                XRaiseWindow(display, window);
+            } else {
+                XSetForeground(display, state.gc, rand());
+                XFillRectangle(display, window, state.gc, rand() % 100, rand() % 100, 8 + rand() % 64,
+                               8 + rand() % 64);
+            }
+            XFlush(display);
+            waiting.push_back(now);
+            next_action += interval;
+        }
+
+        while (XPending(display)) {
+            XEvent ev;
+            XNextEvent(display, &ev);
+            if (ev.type == damage_event + XDamageNotify) {
+                uint64_t presented = monotonic_us();
+                for (uint64_t made : waiting)
+                    result.latencies_us.push_back(presented - made);
+                waiting.clear();
+                XDamageSubtract(display, root_damage, 0, 0);
+            }
+        }
+        read_statistics(stats_fd, pending, result);
+        sleep_us(std::min<uint64_t>(interval, 1000));
+    }
+
+    sleep_us(1100000); // the compositor prints statistics once a second
+    read_statistics(stats_fd, pending, result);
+    result.cpu_ms = cpu_time_ms(compositor) - cpu_start;
+
+    stop(compositor);
+    close(stats_fd);
+    XCloseDisplay(display);
+    stop(xvfb);
+    return result;
+}
+
+static Result run_startup(const Options &options) {
+    char display_name[16];
+    snprintf(display_name, sizeof(display_name), ":%d", free_display_number());
+
+    pid_t xvfb = start_xvfb(options, display_name);
+    Display *display = connect_when_ready(display_name);
+
+    // Small windows, so thousands of them don't eat gigabytes once the compositor redirects them
+    srand(1);
+    Window root = DefaultRootWindow(display);
+    for (int i = 0; i < options.windows; i++) {
+        int size = 8 + rand() % 56;
+        Window window = XCreateSimpleWindow(display, root, rand() % (options.width - size),
+                                            rand() % (options.height - size), size, size, 0, 0, rand());
+        XMapWindow(display, window);
+    }
+    XSync(display, false);
+
+    Result result;
+    int stats_fd;
+    std::string pending;
+    uint64_t start = monotonic_us();
+    pid_t compositor = start_compositor(options, display_name, &stats_fd);
+    while (!result.startup_us && monotonic_us() - start < 60000000) {
+        // While the compositor holds the grab our round trips stall
+        uint64_t sent = monotonic_us();
+        XSync(display, false);
+        result.max_stall_us = std::max(result.max_stall_us, monotonic_us() - sent);
+        read_statistics(stats_fd, pending, result);
+        if (result.startup_us)
+            result.ready_us = monotonic_us() - start;
+        sleep_us(500);
+    }
+    if (!result.startup_us)
+        fprintf(stderr, "The compositor didn't report its startup\n");
+
+    stop(compositor);
+    close(stats_fd);
+    XCloseDisplay(display);
+    stop(xvfb);
+    return result;
+}
+
+static Result run_replay(Options &options) {
+    FILE *file = fopen(options.record, "rb");
+    Event_Record_Header header;
+    if (!file || !event_record_read_header(file, &header)) {
+        fprintf(stderr, "Can't read the event record %s\n", options.record);
+        exit(1);
+    }
+    fclose(file);
+    options.width = header.root_width;
+    options.height = header.root_height;
+
+    char display_name[16];
+    snprintf(display_name, sizeof(display_name), ":%d", free_display_number());
+    pid_t xvfb = start_xvfb(options, display_name);
+    Display *display = connect_when_ready(display_name);
+
+    int stats_fd;
+    pid_t compositor = start_compositor(options, display_name, &stats_fd);
+    if (!wait_for_compositor(display)) {
+        fprintf(stderr, "The compositor didn't start\n");
+        stop(compositor);
+        stop(xvfb);
+        exit(1);
+    }
+
+    Result result;
+    std::string pending;
+    double cpu_start = cpu_time_ms(compositor);
+    uint64_t start = monotonic_us();
+    pid_t replay = fork();
+    if (replay == 0) {
+        setenv("DISPLAY", display_name, 1);
+        execl(REPLAY_PATH, REPLAY_PATH, options.record, nullptr);
+        perror(REPLAY_PATH);
+        _exit(127);
+    }
+    while (waitpid(replay, nullptr, WNOHANG) == 0) {
+        read_statistics(stats_fd, pending, result);
+        sleep_us(10000);
+    }
+    options.seconds = std::max<uint64_t>(1, (monotonic_us() - start) / 1000000);
+
+    sleep_us(1100000); // the compositor prints statistics once a second
+    read_statistics(stats_fd, pending, result);
+    result.cpu_ms = cpu_time_ms(compositor) - cpu_start;
+
+    stop(compositor);
+    close(stats_fd);
+    XCloseDisplay(display);
+    stop(xvfb);
+    return result;
+}
+
+static uint64_t percentile(std::vector<uint64_t> &values, double fraction) {
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, (size_t) (fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static void print_result(const Options &options, const std::string &workload, Result &result) {
+    if (workload == "startup") {
+        printf("{\"workload\":\"startup\",\"windows\":%d,\"startup_us\":%llu,\"grab_us\":%llu,\"ready_us\":%llu,"
+               "\"max_stall_us\":%llu}\n",
+               options.windows, (unsigned long long) result.startup_us, (unsigned long long) result.grab_us,
+               (unsigned long long) result.ready_us, (unsigned long long) result.max_stall_us);
+        fflush(stdout);
+        return;
+    }
+    double frames = result.frames ? result.frames : 1;
+    uint64_t max = result.latencies_us.empty() ? 0 :
+                   *std::max_element(result.latencies_us.begin(), result.latencies_us.end());
+    printf("{\"workload\":\"%s\",\"backend\":\"%s\",\"paint_thread\":%s,\"present\":%s,\"windows\":%d,\"seconds\":%d,\"rate\":%d,\"frames\":%lu,"
+           "\"cpu_ms_per_frame\":%.3f,\"requests_per_frame\":%.1f,\"round_trips_per_frame\":%.2f,"
+           "\"latency_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}}\n",
+           workload.c_str(), options.backend, options.paint_thread ? "true" : "false",
+           options.present ? "true" : "false", options.windows, options.seconds, options.rate, result.frames,
+           result.cpu_ms / frames, result.requests / frames, result.round_trips / frames,
+           (unsigned long long) percentile(result.latencies_us, 0.5),
+           (unsigned long long) percentile(result.latencies_us, 0.9),
+           (unsigned long long) percentile(result.latencies_us, 0.99),
+           (unsigned long long) max);
+    fflush(stdout);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -c  path to the compositor (default %s)\n", COMPOSITOR_PATH);
+    fprintf(stderr, "  -w  workload: damage, drag, restack, argb, shaped, startup, replay, or all (default all)\n");
+    fprintf(stderr, "  -f  event record for the replay workload (see xcompmgr-simple -E)\n");
+    fprintf(stderr, "  -B  compositor backend: xrender or cpu (default xrender)\n");
+    fprintf(stderr, "  -p  run the compositor with its paint thread\n");
+    fprintf(stderr, "  -P  run the compositor with -P, presenting through the overlay window\n");
+    fprintf(stderr, "  -n  number of windows (default 100)\n");
+    fprintf(stderr, "  -t  seconds to run each workload (default 5)\n");
+    fprintf(stderr, "  -r  changes per second (default 1000)\n");
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    int option;
+    while ((option = getopt(argc, argv, "c:w:B:pPf:n:t:r:h")) != -1) {
+        switch (option) {
+            case 'c':
+                options.compositor = optarg;
+                break;
+            case 'w':
+                options.workload = optarg;
+                break;
+            case 'B':
+                options.backend = optarg;
+                break;
+            case 'p':
+                options.paint_thread = true;
+                break;
+            case 'P':
+                options.present = true;
+                break;
+            case 'f':
+                options.record = optarg;
+                break;
+            case 'n':
+                options.windows = std::max(1, atoi(optarg));
+                break;
+            case 't':
+                options.seconds = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                options.rate = std::max(1, atoi(optarg));
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : 1);
+        }
+    }
+
+    const char *workloads[] = {"damage", "drag", "restack", "argb", "shaped", "startup", "replay"};
+    for (const char *workload : workloads) {
+        if (strcmp(options.workload, "all") != 0 && strcmp(options.workload, workload) != 0)
+            continue;
+        if (strcmp(workload, "replay") == 0) {
+            if (!options.record) {
+                if (strcmp(options.workload, "replay") == 0)
+                    fprintf(stderr, "The replay workload needs an event record, give it one with -f\n");
+                continue;
+            }
+            Options replay_options = options;
+            Result result = run_replay(replay_options);
+            print_result(replay_options, workload, result);
+            continue;
+        }
+        Result result = strcmp(workload, "startup") == 0 ? run_startup(options) : run_workload(options, workload);
+        print_result(options, workload, result);
+    }
+    return 0;
+}
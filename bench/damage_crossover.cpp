@@ -0,0 +1,132 @@
+// Measures where covering scattered damage with bigger boxes starts to pay off (see Banded_Region::simplify).
+//
+// Every rectangle of the damage is a clip rectangle for every composite paint_all sends,
+// and every pixel inside them gets blended, so what we want to know is how many pixels one rectangle is worth.
+// We composite a translucent 32 bit picture over a 24 bit one, like a translucent window over the back buffer,
+// with the clip set to:
+//     - one square of a growing size, which gives the cost of a pixel
+//     - a growing number of 1x1 rectangles, which gives the cost of a rectangle
+// and then, for a growing number of glyph sized rectangles scattered over a terminal,
+// compare the damage as it is, simplified with that cost, and its extents.
+//
+// It runs against whatever server DISPLAY points to, so the numbers are that server's:
+//     xvfb-run -s "-screen 0 1920x1080x24" ./bench-damage-crossover
+//
+// Output is one line per test:
+//     test=<name> ... us_per_composite=<us>
+// and last a suggested value for the compositor's -c.
+//
+
+#include "region.h"
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+const int width = 1920;
+const int height = 1080;
+const int rounds = 200;
+
+Display *display;
+Picture source;
+Picture destination;
+
+// Sets the clip and composites rounds times, and waits for the server to be done with all of it
+static double composite_us(const Banded_Region &clip) {
+    std::vector<XRectangle> rectangles;
+    clip.to_rectangles(rectangles);
+    XSync(display, false);
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        XRenderSetPictureClipRectangles(display, destination, 0, 0, rectangles.data(), rectangles.size());
+        XRenderComposite(display, PictOpOver, source, None, destination, 0, 0, 0, 0, 0, 0, width, height);
+    }
+    XSync(display, false);
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / rounds;
+}
+
+static Picture create_picture(int depth, int format) {
+    Pixmap pixmap = XCreatePixmap(display, DefaultRootWindow(display), width, height, depth);
+    Picture picture = XRenderCreatePicture(display, pixmap, XRenderFindStandardFormat(display, format), 0, nullptr);
+    XFreePixmap(display, pixmap);
+    return picture;
+}
+
+// Least squares slope of y over x
+static double slope(const std::vector<double> &x, const std::vector<double> &y) {
+    double mean_x = 0, mean_y = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        mean_x += x[i] / x.size();
+        mean_y += y[i] / y.size();
+    }
+    double covariance = 0, variance = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        covariance += (x[i] - mean_x) * (y[i] - mean_y);
+        variance += (x[i] - mean_x) * (x[i] - mean_x);
+    }
+    return variance ? covariance / variance : 0;
+}
+
+int main() {
+    display = XOpenDisplay(nullptr);
+    if (!display) {
+        fprintf(stderr, "Can't open display, run it under Xvfb or set DISPLAY\n");
+        return 1;
+    }
+    destination = create_picture(24, PictStandardRGB24);
+    source = create_picture(32, PictStandardARGB32);
+    XRenderColor translucent = {0x4000, 0x4000, 0x4000, 0x8000};
+    XRenderFillRectangle(display, PictOpSrc, source, &translucent, 0, 0, width, height);
+
+    std::vector<double> pixels, pixel_us;
+    for (int side = 64; side <= 1024; side *= 2) {
+        double us = composite_us(Banded_Region(0, 0, side, side));
+        pixels.push_back((double) side * side);
+        pixel_us.push_back(us);
+        printf("test=pixels pixels=%d us_per_composite=%.2f\n", side * side, us);
+    }
+
+    std::vector<double> rectangles, rectangle_us;
+    for (int count = 64; count <= 4096; count *= 4) {
+        // Every other pixel of every other row, so none of them touch and the region keeps them all
+        std::vector<XRectangle> dots;
+        for (int i = 0; i < count; i++)
+            dots.push_back({(short) (i % 512 * 2), (short) (i / 512 * 2), 1, 1});
+        Banded_Region clip = Banded_Region::from_rectangles(dots.data(), dots.size());
+        double us = composite_us(clip);
+        rectangles.push_back(clip.box_count());
+        rectangle_us.push_back(us);
+        printf("test=rectangles rectangles=%d us_per_composite=%.2f\n", clip.box_count(), us);
+    }
+
+    double us_per_pixel = slope(pixels, pixel_us);
+    double us_per_rectangle = slope(rectangles, rectangle_us);
+    long box_cost = us_per_pixel > 0 ? (long) (us_per_rectangle / us_per_pixel) : 0;
+
+    // Glyphs changing all over an 80x40 terminal
+    std::mt19937 random(1);
+    const int counts[] = {2, 4, 8, 16, 32, 64, 128, 256, 512};
+    for (int count : counts) {
+        std::vector<XRectangle> glyphs;
+        for (int i = 0; i < count; i++)
+            glyphs.push_back({(short) (100 + random() % 80 * 8), (short) (100 + random() % 40 * 16), 8, 16});
+        Banded_Region exact = Banded_Region::from_rectangles(glyphs.data(), glyphs.size());
+        Banded_Region simplified = exact;
+        simplified.simplify(16, box_cost);
+        Banded_Region extents(exact.extents());
+        printf("test=glyphs glyphs=%d exact_boxes=%d exact_us=%.2f simplified_boxes=%d simplified_us=%.2f extents_us=%.2f\n",
+               count, exact.box_count(), composite_us(exact),
+               simplified.box_count(), composite_us(simplified), composite_us(extents));
+    }
+
+    printf("us_per_pixel=%.6f us_per_rectangle=%.4f suggested_box_cost=%ld\n",
+           us_per_pixel, us_per_rectangle, box_cost);
+    XCloseDisplay(display);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Measures the occlusion pass of paint_all with the windows in a Paint_List against walking the Client_Stack.
+//
+// The desktop is a lot of windows, most of them on other workspaces (unmapped, so never drawn to)
+// or moved off the screen, and a few hundred on it, some of them translucent.
+// Every frame a glyph sized piece somewhere on the screen gets damaged, and the occlusion pass works out
+// the border_clip of every window that shows in it, like paint_all does:
+//     - walk: follows Client::below from the top and checks every window, like paint_all used to
+//     - list: finds the windows near the damage with Paint_List::find_candidates and only looks at those
+// The clients come from a Client_Pool and get restacked at random, so the walk jumps around memory
+// the way it does after a few hours of use.
+//
+// Output is one line per window count:
+//     windows=<n> walk_ns=<ns per frame> list_ns=<ns per frame> candidates=<windows looked at per frame>
+//
+
+#include "client_pool.h"
+#include "client_stack.h"
+#include "paint_list.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+
+const int root_width = 1920;
+const int root_height = 1080;
+const int frames = 2000;
+
+// The occlusion pass as it was, straight down the stack
+static void walk(const Banded_Region &damage, Client *top) {
+    Banded_Region region = damage;
+    for (Client *w = top; w; w = w->below) {
+        if (region.empty())
+            break;
+        if (!w->damaged)
+            continue;
+        if (w->attr.x + w->attr.width < 1 || w->attr.y + w->attr.height < 1
+            || w->attr.x >= root_width || w->attr.y >= root_height)
+            continue;
+        w->border_clip = region;
+        w->border_clip.intersect(w->border_size);
+        if (!w->border_clip.empty() && w->opaqueness == Window_Opaqueness::SOLID)
+            region.subtract(w->border_size);
+    }
+}
+
+// The occlusion pass as it is now
+static size_t list(const Banded_Region &damage, Paint_List &list) {
+    static std::vector<int> candidates;
+    Banded_Region region = damage;
+    candidates.clear();
+    for (size_t first = 0; first < list.size() && !region.empty(); first += Paint_List::block_size) {
+        size_t next = candidates.size();
+        list.find_candidates(region.extents(), first, first + Paint_List::block_size, candidates);
+        for (; next < candidates.size() && !region.empty(); next++) {
+            Client *w = list.clients[candidates[next]];
+            w->border_clip = region;
+            w->border_clip.intersect(w->border_size);
+            if (!w->border_clip.empty() && w->opaqueness == Window_Opaqueness::SOLID)
+                region.subtract(w->border_size);
+        }
+    }
+    return candidates.size();
+}
+
+static double nanoseconds_since(std::chrono::steady_clock::time_point start, int iterations) {
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main() {
+    const int window_counts[] = {100, 1000, 10000};
+
+    for (int window_count : window_counts) {
+        Client_Pool pool;
+        Client_Stack stack;
+        std::vector<Client *> all;
+        std::mt19937 random(window_count);
+
+        for (int i = 0; i < window_count; i++) {
+            Client *client = pool.acquire();
+            client->window = 0x1000000 + i;
+            client->attr = XWindowAttributes();
+            int place = random() % 10;
+            client->attr.width = 200 + random() % 600;
+            client->attr.height = 100 + random() % 500;
+            if (place == 0) {
+                // Moved off the screen, like some window managers do with other workspaces
+                client->attr.x = root_width * (1 + random() % 4);
+                client->attr.y = random() % root_height;
+            } else {
+                client->attr.x = random() % (root_width - 100);
+                client->attr.y = random() % (root_height - 100);
+            }
+            // Only a few hundred are on the current workspace
+            client->damaged = place == 0 || (int) (random() % window_count) < 300;
+            client->opaqueness = random() % 4 ? Window_Opaqueness::SOLID : Window_Opaqueness::ARGB;
+            client->border_size = Banded_Region(client->attr.x, client->attr.y, client->attr.width, client->attr.height);
+            client->above = nullptr;
+            client->below = nullptr;
+            stack.push_top(client);
+            all.push_back(client);
+        }
+        for (int i = 0; i < window_count * 4; i++)
+            stack.move_to_top(all[random() % window_count]);
+
+        Paint_List paint_list;
+        paint_list.build(stack);
+
+        std::vector<Banded_Region> damage;
+        for (int i = 0; i < frames; i++)
+            damage.push_back(Banded_Region(random() % (root_width - 8), random() % (root_height - 16), 8, 16));
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++)
+            walk(damage[i], stack.top);
+        double walk_ns = nanoseconds_since(start, frames);
+
+        size_t candidates = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++)
+            candidates += list(damage[i], paint_list);
+        double list_ns = nanoseconds_since(start, frames);
+
+        printf("windows=%d walk_ns=%.0f list_ns=%.0f candidates=%.1f\n",
+               window_count, walk_ns, list_ns, (double) candidates / frames);
+    }
+    return 0;
+}
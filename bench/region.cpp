@@ -0,0 +1,100 @@
+// Measures Banded_Region on the kind of work paint_all does every frame.
+//
+// For each window count we build a stack of random windows on a 3840x2160 screen,
+// and then, like the first loop of paint_all, walk it front to back
+// subtracting every window from the damage while keeping a copy of what's left for each window.
+// The second loop's intersect of that copy with the window's shape is timed separately.
+// We also time merging a lot of small damage rectangles, which is what add_damage sees from terminals,
+// and covering the result with fewer boxes (simplify, see bench-damage-crossover for what that saves the server).
+//
+// Output is one line per test:
+//     test=<name> windows=<n> ns_per_op=<ns> boxes=<rectangles in the result>
+//
+
+#include "region.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stdio.h>
+
+const int screen_width = 3840;
+const int screen_height = 2160;
+
+static double nanoseconds_since(std::chrono::steady_clock::time_point start, long operations) {
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / operations;
+}
+
+static std::vector<Banded_Region> random_windows(std::mt19937 &random, int count) {
+    std::vector<Banded_Region> windows;
+    for (int i = 0; i < count; i++) {
+        int width = 50 + random() % 1200;
+        int height = 30 + random() % 900;
+        windows.emplace_back(random() % screen_width - 100, random() % screen_height - 100, width, height);
+    }
+    return windows;
+}
+
+int main() {
+    const int window_counts[] = {10, 100, 1000};
+    std::mt19937 random(1);
+
+    for (int window_count : window_counts) {
+        std::vector<Banded_Region> windows = random_windows(random, window_count);
+        int rounds = 100000 / window_count;
+
+        std::vector<Banded_Region> clips(window_count);
+        Banded_Region region;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            region = Banded_Region(0, 0, screen_width, screen_height);
+            for (int i = 0; i < window_count; i++) {
+                clips[i] = region;
+                region.subtract(windows[i]);
+            }
+        }
+        printf("test=subtract windows=%d ns_per_op=%.1f boxes=%d\n",
+               window_count, nanoseconds_since(start, (long) rounds * window_count), region.box_count());
+
+        long boxes = 0;
+        start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            for (int i = 0; i < window_count; i++) {
+                Banded_Region clip = clips[i];
+                clip.intersect(windows[i]);
+                boxes += clip.box_count();
+            }
+        }
+        printf("test=intersect windows=%d ns_per_op=%.1f boxes=%ld\n",
+               window_count, nanoseconds_since(start, (long) rounds * window_count), boxes / rounds);
+    }
+
+    const int damage_counts[] = {10, 100, 1000};
+    for (int damage_count : damage_counts) {
+        std::vector<Banded_Region> damage;
+        for (int i = 0; i < damage_count; i++)
+            damage.emplace_back(random() % screen_width, random() % screen_height, 8, 16);
+        int rounds = 100000 / damage_count;
+
+        Banded_Region all_damage;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            all_damage.clear();
+            for (const Banded_Region &part : damage)
+                all_damage.unite(part);
+        }
+        printf("test=unite rectangles=%d ns_per_op=%.1f boxes=%d\n",
+               damage_count, nanoseconds_since(start, (long) rounds * damage_count), all_damage.box_count());
+
+        Banded_Region simplified;
+        start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            simplified = all_damage;
+            simplified.simplify(16, 2000);
+        }
+        printf("test=simplify rectangles=%d ns_per_op=%.1f boxes=%d\n",
+               damage_count, nanoseconds_since(start, rounds), simplified.box_count());
+    }
+    return 0;
+}
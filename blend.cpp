@@ -0,0 +1,130 @@
+#include "blend.h"
+
+#if BLEND_HAVE_X86
+#include <immintrin.h>
+#endif
+
+// x * y / 255, rounded, for x and y up to 255
+static inline uint32_t multiply_255(uint32_t x, uint32_t y) {
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+// Multiplies all four channels of a pixel by factor / 255
+static inline uint32_t scale_pixel(uint32_t pixel, uint32_t factor) {
+    return multiply_255(pixel & 0xff, factor) |
+           multiply_255((pixel >> 8) & 0xff, factor) << 8 |
+           multiply_255((pixel >> 16) & 0xff, factor) << 16 |
+           multiply_255(pixel >> 24, factor) << 24;
+}
+
+static inline uint32_t over_pixel(uint32_t dst, uint32_t src, int opacity, bool opaque_source) {
+    if (opaque_source)
+        src |= 0xff000000;
+    if (opacity != 255)
+        src = scale_pixel(src, opacity);
+    uint32_t alpha = src >> 24;
+    if (alpha == 255)
+        return src;
+    // Premultiplied pixels can't add up to more than 255, but a window isn't made to send us those,
+    // so every channel saturates on its own like packus does in the vector versions
+    uint32_t under = scale_pixel(dst, 255 - alpha);
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = ((src >> shift) & 0xff) + ((under >> shift) & 0xff);
+        result |= (sum > 255 ? 255 : sum) << shift;
+    }
+    return result;
+}
+
+void blend_over_scalar(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source) {
+    for (int i = 0; i < count; i++)
+        dst[i] = over_pixel(dst[i], src[i], opacity, opaque_source);
+}
+
+#if BLEND_HAVE_X86
+
+// The vector versions work on the channels widened to 16 bits, two pixels per 128 bits.
+// (x + 128 + ((x + 128) >> 8)) >> 8 is x / 255 rounded, and for x up to 255 * 255 it never leaves 16 bits.
+
+static inline __m128i divide_255_sse2(__m128i x) {
+    __m128i t = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Copies the alpha of each of the two pixels into all four of its channels
+static inline __m128i spread_alpha_sse2(__m128i pixels) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static inline __m128i over_half_sse2(__m128i dst, __m128i src, __m128i opacity, bool scale) {
+    if (scale)
+        src = divide_255_sse2(_mm_mullo_epi16(src, opacity));
+    __m128i inverse_alpha = _mm_sub_epi16(_mm_set1_epi16(255), spread_alpha_sse2(src));
+    return _mm_add_epi16(src, divide_255_sse2(_mm_mullo_epi16(dst, inverse_alpha)));
+}
+
+void blend_over_sse2(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_bits = _mm_set1_epi32(opaque_source ? (int) 0xff000000 : 0);
+    const __m128i opacity_16 = _mm_set1_epi16(opacity);
+    const bool scale = opacity != 255;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_or_si128(_mm_loadu_si128((const __m128i *) (src + i)), alpha_bits);
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i low = over_half_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), opacity_16, scale);
+        __m128i high = over_half_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), opacity_16, scale);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(low, high));
+    }
+    blend_over_scalar(dst + i, src + i, count - i, opacity, opaque_source);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divide_255_avx2(__m256i x) {
+    __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i over_half_avx2(__m256i dst, __m256i src, __m256i opacity, bool scale) {
+    if (scale)
+        src = divide_255_avx2(_mm256_mullo_epi16(src, opacity));
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)),
+                                           _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i inverse_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    return _mm256_add_epi16(src, divide_255_avx2(_mm256_mullo_epi16(dst, inverse_alpha)));
+}
+
+// Same as the SSE2 version, 8 pixels at a time.
+// Unpacking and packing both work inside each 128 bit half, so the pixels come back out in the right order.
+__attribute__((target("avx2")))
+void blend_over_avx2(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_bits = _mm256_set1_epi32(opaque_source ? (int) 0xff000000 : 0);
+    const __m256i opacity_16 = _mm256_set1_epi16(opacity);
+    const bool scale = opacity != 255;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (src + i)), alpha_bits);
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        __m256i low = over_half_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), opacity_16, scale);
+        __m256i high = over_half_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), opacity_16,
+                                      scale);
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(low, high));
+    }
+    blend_over_sse2(dst + i, src + i, count - i, opacity, opaque_source);
+}
+
+#endif
+
+Blend_Over_Function best_blend_over() {
+#if BLEND_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blend_over_avx2;
+    return blend_over_sse2; // every x86_64 has SSE2
+#else
+    return blend_over_scalar;
+#endif
+}
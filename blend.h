@@ -0,0 +1,31 @@
+#ifndef XCOMPMGR_SIMPLE_BLEND_H
+#define XCOMPMGR_SIMPLE_BLEND_H
+
+#include <stdint.h>
+
+// Pixel kernels for the CPU backend (-B cpu).
+//
+// Pixels are 32 bit a8r8g8b8 with premultiplied alpha, the way X stores depth 32 windows.
+// Depth 24 windows leave the top byte undefined, so for those opaque_source says to treat every pixel as opaque.
+//
+// blend_over puts count pixels of src over dst (the Render Over operator),
+// after multiplying src with opacity (255 leaves it alone), which is how _NET_WM_WINDOW_OPACITY gets applied.
+//
+// There's a plain C++ version and SSE2 and AVX2 versions that do 4 and 8 pixels at once.
+// They all round the same way, and saturate each channel at 255 when a source that isn't premultiplied
+// adds up to more, so they give the exact same result for any input.
+//
+typedef void (*Blend_Over_Function)(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source);
+
+void blend_over_scalar(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_HAVE_X86 1
+void blend_over_sse2(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source);
+void blend_over_avx2(uint32_t *dst, const uint32_t *src, int count, int opacity, bool opaque_source);
+#endif
+
+// The fastest version this CPU can run
+Blend_Over_Function best_blend_over();
+
+#endif
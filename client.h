@@ -0,0 +1,58 @@
+#ifndef XCOMPMGR_SIMPLE_CLIENT_H
+#define XCOMPMGR_SIMPLE_CLIENT_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xrender.h>
+
+#include "region.h"
+
+enum Window_Opaqueness {
+    SOLID = 0,
+    TRANSPARENT = 1,
+    ARGB = 2,
+};
+
+class Client {
+public:
+    Window window;
+    Pixmap pixmap;
+    XWindowAttributes attr;
+    bool attributes_pending; // attr is still on its way from the server (see add_client)
+    Window_Opaqueness opaqueness;
+    int damaged;
+    Damage damage;
+    Picture picture;
+    unsigned int pixmap_generation; // changes whenever pixmap has to be named again (see release_client_pixmap)
+    int opacity_level; // _NET_WM_WINDOW_OPACITY, 0 to 255 (see get_alpha_picture)
+    Banded_Region border_size; // the shape of the window on the screen, borders included
+    bool border_size_valid; // false when border_size has to be worked out again (see get_border_size)
+    Banded_Region extents; // the rectangle the window covers on the screen, empty while it isn't shown
+    bool shaped;
+    Banded_Region shape; // the bounding shape as the server last sent it, moved to where the window is now
+    bool shape_valid; // false until the next ShapeNotify has been answered
+    XRectangle shape_bounds;
+
+    Banded_Region border_clip; // the part of the damage the window gets drawn into this frame
+
+    Banded_Region pending_damage; // damage reported since the last frame, in screen coordinates
+    bool damage_dirty; // pending_damage is waiting to be acknowledged (see acknowledge_damage)
+    // Damage throttling (see acknowledge_damage)
+    unsigned int max_damage_hz; // _XCOMPMGR_DAMAGE_HZ, 0 when the window doesn't set it
+    uint64_t damage_honoured_us; // when its damage last went into a frame
+    unsigned int damage_events; // since the rates were last worked out (see update_damage_rates)
+    unsigned int damage_deferrals; // times its damage was held back, since the rates were last worked out
+    unsigned int damage_rate; // damage events in the last second
+    unsigned int deferral_rate; // times its damage was held back in the last second
+
+    int paint_index; // where it is in the Paint_List it was last put in
+    bool thumbnail_stale; // damaged since its thumbnail was last drawn (see handle_thumbnail_request)
+
+    // Neighbours in the stacking order (see Client_Stack).
+    // above is closer to the top of the screen, below is closer to the desktop.
+    Client *above;
+    Client *below;
+};
+
+#endif
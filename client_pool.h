@@ -0,0 +1,69 @@
+#ifndef XCOMPMGR_SIMPLE_CLIENT_POOL_H
+#define XCOMPMGR_SIMPLE_CLIENT_POOL_H
+
+#include "client.h"
+
+#include <memory>
+#include <vector>
+
+// Hands out Client objects from slabs that are allocated once and never given back to the system.
+//
+// Windows come and go all day long, so instead of a new and delete for every one of them
+// a destroyed client goes on a free list (threaded through Client::below, it isn't in the stack anymore)
+// and the next window that shows up gets it.
+// The memory used is then set by the most windows that ever existed at the same time,
+// not by how many were ever created, and a reused client keeps the memory its regions already grew to.
+//
+class Client_Pool {
+public:
+    static const int slab_size = 64;
+
+    // The caller has to fill in every field
+    Client *acquire() {
+        if (!free_list)
+            add_slab();
+        Client *client = free_list;
+        free_list = client->below;
+        client->below = nullptr;
+        live++;
+        return client;
+    }
+
+    void release(Client *client) {
+        client->border_size.clear();
+        client->shape.clear();
+        client->extents.clear();
+        client->border_clip.clear();
+        client->pending_damage.clear();
+        client->above = nullptr;
+        client->below = free_list;
+        free_list = client;
+        live--;
+    }
+
+    // Clients handed out right now
+    size_t live_count() const {
+        return live;
+    }
+
+    // Clients there is memory for, handed out or not
+    size_t capacity() const {
+        return slabs.size() * slab_size;
+    }
+
+private:
+    std::vector<std::unique_ptr<Client[]>> slabs;
+    Client *free_list = nullptr;
+    size_t live = 0;
+
+    void add_slab() {
+        slabs.emplace_back(new Client[slab_size]);
+        Client *slab = slabs.back().get();
+        for (int i = slab_size - 1; i >= 0; i--) {
+            slab[i].below = free_list;
+            free_list = &slab[i];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef XCOMPMGR_SIMPLE_CLIENT_STACK_H
+#define XCOMPMGR_SIMPLE_CLIENT_STACK_H
+
+#include "client.h"
+
+#include <unordered_map>
+
+// Holds every client we know about in stacking order.
+//
+// The order is kept as a doubly linked list threaded through Client::above and Client::below
+// (top is the window closest to the user, bottom is the one sitting right on the desktop)
+// and next to it there is a hash map from Window to Client.
+// Together this means finding a client for an event, and moving a client somewhere else in the stack,
+// costs the same whether there are 10 windows or 10,000.
+//
+class Client_Stack {
+public:
+    Client *top = nullptr;
+    Client *bottom = nullptr;
+    unsigned long generation = 0; // changes whenever the order does (see Paint_List)
+
+    Client *find(Window window) const {
+        auto it = index.find(window);
+        if (it == index.end())
+            return nullptr;
+        return it->second;
+    }
+
+    size_t size() const {
+        return index.size();
+    }
+
+    bool empty() const {
+        return index.empty();
+    }
+
+    // Adds a client that isn't in the stack yet on top of every other client
+    void push_top(Client *client) {
+        index[client->window] = client;
+        link_above(client, top);
+    }
+
+    // Takes the client out of the stack, it's up to the caller to free it
+    void remove(Client *client) {
+        unlink(client);
+        index.erase(client->window);
+    }
+
+    // Places the client directly above the sibling,
+    // or at the very bottom of the stack when sibling is 0 (which is what X sends us in ConfigureNotify.above).
+    // If we don't know the sibling the client is left where it is.
+    void place_above(Client *client, Window sibling) {
+        if (sibling == 0) {
+            move_to_bottom(client);
+            return;
+        }
+        Client *below = find(sibling);
+        if (below == nullptr || below == client || below->above == client)
+            return;
+        unlink(client);
+        link_above(client, below);
+    }
+
+    void move_to_top(Client *client) {
+        if (top == client)
+            return;
+        unlink(client);
+        link_above(client, top);
+    }
+
+    void move_to_bottom(Client *client) {
+        if (bottom == client)
+            return;
+        unlink(client);
+        link_above(client, nullptr);
+    }
+
+private:
+    std::unordered_map<Window, Client *> index;
+
+    void unlink(Client *client) {
+        generation++;
+        if (client->above)
+            client->above->below = client->below;
+        else
+            top = client->below;
+        if (client->below)
+            client->below->above = client->above;
+        else
+            bottom = client->above;
+        client->above = nullptr;
+        client->below = nullptr;
+    }
+
+    // Puts the client directly above below, or at the very bottom of the stack when below is null
+    void link_above(Client *client, Client *below) {
+        generation++;
+        Client *above = below ? below->above : bottom;
+        client->below = below;
+        client->above = above;
+        if (below)
+            below->above = client;
+        else
+            bottom = client;
+        if (above)
+            above->below = client;
+        else
+            top = client;
+    }
+};
+
+#endif
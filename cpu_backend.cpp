@@ -0,0 +1,80 @@
+#include "cpu_backend.h"
+
+#include <X11/Xutil.h>
+
+#include <algorithm>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+bool create_shm_image(Display *display, Visual *visual, int depth, int width, int height, Shm_Image &out) {
+    XImage *image = XShmCreateImage(display, visual, depth, ZPixmap, nullptr, &out.info, width, height);
+    if (!image)
+        return false;
+    if (image->bits_per_pixel != 32) {
+        XDestroyImage(image);
+        return false;
+    }
+
+    out.info.shmid = shmget(IPC_PRIVATE, (size_t) image->bytes_per_line * height, IPC_CREAT | 0600);
+    if (out.info.shmid < 0) {
+        XDestroyImage(image);
+        return false;
+    }
+    out.info.shmaddr = image->data = (char *) shmat(out.info.shmid, nullptr, 0);
+    // Marked for removal right away, it stays around until both we and the server have detached
+    shmctl(out.info.shmid, IPC_RMID, nullptr);
+    if (out.info.shmaddr == (char *) -1) {
+        image->data = nullptr;
+        XDestroyImage(image);
+        return false;
+    }
+    out.info.readOnly = false;
+    if (!XShmAttach(display, &out.info)) {
+        shmdt(out.info.shmaddr);
+        image->data = nullptr;
+        XDestroyImage(image);
+        return false;
+    }
+    out.image = image;
+    return true;
+}
+
+void destroy_shm_image(Display *display, Shm_Image &image) {
+    if (!image.image)
+        return;
+    XShmDetach(display, &image.info);
+    shmdt(image.info.shmaddr);
+    image.image->data = nullptr; // not ours to free, it's the shared memory
+    XDestroyImage(image.image);
+    image.image = nullptr;
+}
+
+void fill_tiled(const Shm_Image &image, const Region_Box &box, const uint32_t *tile, int tile_width, int tile_height) {
+    for (int y = box.y1; y < box.y2; y++) {
+        uint32_t *row = shm_image_row(image, y);
+        const uint32_t *tile_row = tile + (long) (y % tile_height) * tile_width;
+        int x = box.x1;
+        while (x < box.x2) {
+            int tile_x = x % tile_width;
+            int count = std::min(box.x2 - x, tile_width - tile_x);
+            memcpy(row + x, tile_row + tile_x, count * sizeof(uint32_t));
+            x += count;
+        }
+    }
+}
+
+void blend_box(const Shm_Image &image, const Region_Box &box,
+               const uint32_t *source, int source_x, int source_y, int source_width,
+               Blend_Over_Function blend, int opacity, bool opaque_source) {
+    int width = box.x2 - box.x1;
+    for (int y = box.y1; y < box.y2; y++) {
+        uint32_t *row = shm_image_row(image, y) + box.x1;
+        const uint32_t *source_row = source + (long) (y - source_y) * source_width + (box.x1 - source_x);
+        // Nothing to blend with, it simply replaces what's there
+        if (opaque_source && opacity == 255)
+            memcpy(row, source_row, width * sizeof(uint32_t));
+        else
+            blend(row, source_row, width, opacity, opaque_source);
+    }
+}
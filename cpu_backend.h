@@ -0,0 +1,45 @@
+#ifndef XCOMPMGR_SIMPLE_CPU_BACKEND_H
+#define XCOMPMGR_SIMPLE_CPU_BACKEND_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include <stdint.h>
+
+#include "blend.h"
+#include "region.h"
+
+// The CPU backend (-B cpu) composites on our side instead of with XRender:
+// window contents are copied out of the server with XShmGetImage, blended into a framebuffer
+// that lives in shared memory, and the damaged parts of that are put on the screen with XShmPutImage.
+// Only the pixels go through shared memory, so nothing is copied over the socket,
+// but the server and the compositor have to be on the same machine.
+//
+// This file has the pieces that don't know about clients, paint_all in xcompmgr-simple.cpp drives them.
+//
+
+// An XImage whose pixels are in a shared memory segment the server has attached too
+struct Shm_Image {
+    XShmSegmentInfo info;
+    XImage *image = nullptr;
+};
+
+// Only 32 bits per pixel images are supported, which is what depth 24 and 32 use everywhere
+bool create_shm_image(Display *display, Visual *visual, int depth, int width, int height, Shm_Image &out);
+
+void destroy_shm_image(Display *display, Shm_Image &image);
+
+inline uint32_t *shm_image_row(const Shm_Image &image, int y) {
+    return (uint32_t *) (image.image->data + (long) y * image.image->bytes_per_line);
+}
+
+// Fills the box of the image by repeating the tile (the wallpaper) from the image's origin
+void fill_tiled(const Shm_Image &image, const Region_Box &box, const uint32_t *tile, int tile_width, int tile_height);
+
+// Blends the box of the source over the same box of the image.
+// The source holds the pixels of (source_x, source_y) to (source_x + source_width, ...) in image coordinates.
+void blend_box(const Shm_Image &image, const Region_Box &box,
+               const uint32_t *source, int source_x, int source_y, int source_width,
+               Blend_Over_Function blend, int opacity, bool opaque_source);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef XCOMPMGR_SIMPLE_EVENT_RECORD_H
+#define XCOMPMGR_SIMPLE_EVENT_RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Event recording (-E file) and replay (xcompmgr-simple-replay, tools/replay.cpp).
+//
+// The compositor writes down every event it handles that changes what's on the screen,
+// so a session that stuttered can be played back on Xvfb and every change to the compositor measured against it.
+// The file is a header followed by fixed size records, in the byte order of the machine that recorded it.
+// Besides the events there are two records the compositor makes up itself:
+//     RECORD_WINDOW  - what a window looked like when we first got its attributes, which is the only record
+//                      of the windows that existed before we started, and the only place depth shows up
+//     RECORD_OPACITY - the value of _NET_WM_WINDOW_OPACITY whenever it changed, PropertyNotify doesn't have it
+//
+const uint32_t event_record_magic = 0x78637276;
+const uint32_t event_record_version = 1;
+
+struct Event_Record_Header {
+    uint32_t magic;
+    uint32_t version;
+    uint16_t root_width;
+    uint16_t root_height;
+    uint32_t root_window; // the root of the recorded display, ReparentNotify to it means a new top level window
+};
+
+enum Event_Record_Type {
+    RECORD_WINDOW = 1,
+    RECORD_CREATE,
+    RECORD_DESTROY,
+    RECORD_MAP,
+    RECORD_UNMAP,
+    RECORD_CONFIGURE, // sibling is the window it's now above, 0 for the bottom
+    RECORD_REPARENT, // sibling is the new parent
+    RECORD_CIRCULATE, // value is PlaceOnTop or PlaceOnBottom
+    RECORD_DAMAGE, // the rectangle is in window coordinates
+    RECORD_SHAPE, // the bounding shape's extents in window coordinates, RECORD_SHAPED when it has one
+    RECORD_EXPOSE, // on the root
+    RECORD_OPACITY, // value is the opacity level, 0 to 255
+};
+
+enum Event_Record_Flags {
+    RECORD_OVERRIDE_REDIRECT = 1,
+    RECORD_VIEWABLE = 2,
+    RECORD_ARGB = 4,
+    RECORD_SHAPED = 8,
+    RECORD_INPUT_ONLY = 16,
+};
+
+struct Event_Record {
+    uint64_t time_us; // since the recording started
+    uint32_t window;
+    uint32_t sibling;
+    int16_t x, y;
+    uint16_t width, height;
+    uint16_t border_width;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t value;
+};
+
+inline bool event_record_write_header(FILE *file, uint32_t root_window, int root_width, int root_height) {
+    Event_Record_Header header = {};
+    header.magic = event_record_magic;
+    header.version = event_record_version;
+    header.root_width = root_width;
+    header.root_height = root_height;
+    header.root_window = root_window;
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+inline bool event_record_read_header(FILE *file, Event_Record_Header *header) {
+    return fread(header, sizeof(*header), 1, file) == 1 &&
+           header->magic == event_record_magic && header->version == event_record_version;
+}
+
+#endif
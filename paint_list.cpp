@@ -0,0 +1,37 @@
+#include "paint_list.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void Paint_List::find_candidates(const Region_Box &bounds, size_t first, size_t last,
+                                 std::vector<int> &candidates) const {
+    if (last > clients.size())
+        last = clients.size();
+    size_t i = first;
+#ifdef __SSE2__
+    // A window overlaps when x1 < bounds.x2, x2 > bounds.x1, and the same for y,
+    // four windows to a compare, and movemask hands us one bit per window that passed all of them
+    const __m128i left_of = _mm_set1_epi32(bounds.x2);
+    const __m128i right_of = _mm_set1_epi32(bounds.x1);
+    const __m128i above = _mm_set1_epi32(bounds.y2);
+    const __m128i below = _mm_set1_epi32(bounds.y1);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= last; i += 4) {
+        __m128i hit = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) &damaged[i]), zero);
+        hit = _mm_and_si128(hit, _mm_cmplt_epi32(_mm_loadu_si128((const __m128i *) &x1[i]), left_of));
+        hit = _mm_and_si128(hit, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) &x2[i]), right_of));
+        hit = _mm_and_si128(hit, _mm_cmplt_epi32(_mm_loadu_si128((const __m128i *) &y1[i]), above));
+        hit = _mm_and_si128(hit, _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) &y2[i]), below));
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(hit));
+        for (int j = 0; bits; j++, bits >>= 1) {
+            if (bits & 1)
+                candidates.push_back(i + j);
+        }
+    }
+#endif
+    for (; i < last; i++) {
+        if (damaged[i] && x1[i] < bounds.x2 && x2[i] > bounds.x1 && y1[i] < bounds.y2 && y2[i] > bounds.y1)
+            candidates.push_back(i);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef XCOMPMGR_SIMPLE_PAINT_LIST_H
+#define XCOMPMGR_SIMPLE_PAINT_LIST_H
+
+#include "client.h"
+#include "client_stack.h"
+
+#include <vector>
+
+// What paint_all looks at for every window every frame, in arrays in stacking order.
+//
+// Walking the Client_Stack means following above and below from one Client to the next,
+// and most of a Client is never looked at while painting (the XWindowAttributes alone are over 100 bytes),
+// so with thousands of windows the occlusion pass mostly waits on cache misses.
+// Here the rectangle every window covers, and whether it has anything to show, sit next to those of its neighbours,
+// and finding the windows a frame can touch at all is a pass over a few small arrays (find_candidates)
+// that checks four windows at once with SSE2.
+// Only the windows that come out of it get their Client, with its regions and X resources, looked at.
+//
+// The order is built again whenever the Client_Stack changed it (Client_Stack::generation),
+// a window that changed without moving in the stack just gets its entry updated (update).
+//
+class Paint_List {
+public:
+    static const size_t block_size = 64; // windows paint_all hands find_candidates at a time
+    std::vector<Client *> clients; // top to bottom
+    // The rectangle each window covers on the screen, borders included
+    std::vector<int> x1, y1, x2, y2;
+    std::vector<int> damaged; // 1 when drawn to at least once, so it has something to show
+    unsigned long generation = 0; // of the Client_Stack it was built from
+
+    size_t size() const {
+        return clients.size();
+    }
+
+    void clear() {
+        clients.clear();
+        x1.clear();
+        y1.clear();
+        x2.clear();
+        y2.clear();
+        damaged.clear();
+    }
+
+    // Adds a window below every window already in the list
+    void push_bottom(Client *client) {
+        client->paint_index = clients.size();
+        clients.push_back(client);
+        x1.push_back(0);
+        y1.push_back(0);
+        x2.push_back(0);
+        y2.push_back(0);
+        damaged.push_back(0);
+        update(client);
+    }
+
+    void build(const Client_Stack &stack) {
+        clear();
+        for (Client *w = stack.top; w; w = w->below)
+            push_bottom(w);
+        generation = stack.generation;
+    }
+
+    // Copies what changed about the window into its entry.
+    // If the list is out of date (the window isn't where it says it is) it gets built again before it's used anyway.
+    void update(const Client *client) {
+        size_t i = client->paint_index;
+        if (i >= clients.size() || clients[i] != client)
+            return;
+        const XWindowAttributes &attr = client->attr;
+        x1[i] = attr.x;
+        y1[i] = attr.y;
+        x2[i] = attr.x + attr.width + attr.border_width * 2;
+        y2[i] = attr.y + attr.height + attr.border_width * 2;
+        damaged[i] = client->damaged != 0;
+    }
+
+    // Adds the index of every window from first up to last (or the end) that was drawn to and overlaps bounds
+    // to the end of candidates, top to bottom.
+    // Windows that aren't on the screen at all never overlap the damage, so they're left out as well.
+    void find_candidates(const Region_Box &bounds, size_t first, size_t last, std::vector<int> &candidates) const;
+};
+
+#endif
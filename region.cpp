@@ -0,0 +1,402 @@
+#include "region.h"
+
+#include <algorithm>
+#include <limits.h>
+
+// The operations are all done the same way:
+// we walk both regions from top to bottom, cutting the screen into horizontal strips
+// wherever a band of either region starts or stops.
+// Inside one strip both regions are just a list of spans on the x axis,
+// so we combine those spans, and the result becomes a band of the output.
+//
+enum Region_Op {
+    UNITE,
+    SUBTRACT,
+    INTERSECT,
+};
+
+struct Span {
+    int x1, x2;
+};
+
+static bool boxes_overlap(const Region_Box &a, const Region_Box &b) {
+    return a.x1 < b.x2 && b.x1 < a.x2 && a.y1 < b.y2 && b.y1 < a.y2;
+}
+
+static bool box_contains(const Region_Box &outer, const Region_Box &inner) {
+    return outer.x1 <= inner.x1 && outer.y1 <= inner.y1 && outer.x2 >= inner.x2 && outer.y2 >= inner.y2;
+}
+
+// Returns the index one past the last box of the band starting at start
+static int band_end(const std::vector<Region_Box> &boxes, int start) {
+    int end = start;
+    int count = boxes.size();
+    while (end < count && boxes[end].y1 == boxes[start].y1)
+        end++;
+    return end;
+}
+
+static void add_span(std::vector<Span> &spans, int x1, int x2) {
+    // Touching spans are merged so that a band never has two boxes next to each other
+    if (!spans.empty() && spans.back().x2 >= x1) {
+        spans.back().x2 = std::max(spans.back().x2, x2);
+        return;
+    }
+    spans.push_back({x1, x2});
+}
+
+static void combine_spans(Region_Op op,
+                          const Region_Box *a, int a_count,
+                          const Region_Box *b, int b_count,
+                          std::vector<Span> &spans) {
+    int i = 0;
+    int j = 0;
+    switch (op) {
+        case UNITE:
+            while (i < a_count || j < b_count) {
+                if (j == b_count || (i < a_count && a[i].x1 <= b[j].x1)) {
+                    add_span(spans, a[i].x1, a[i].x2);
+                    i++;
+                } else {
+                    add_span(spans, b[j].x1, b[j].x2);
+                    j++;
+                }
+            }
+            break;
+        case INTERSECT:
+            while (i < a_count && j < b_count) {
+                int x1 = std::max(a[i].x1, b[j].x1);
+                int x2 = std::min(a[i].x2, b[j].x2);
+                if (x1 < x2)
+                    spans.push_back({x1, x2});
+                if (a[i].x2 < b[j].x2)
+                    i++;
+                else
+                    j++;
+            }
+            break;
+        case SUBTRACT:
+            for (; i < a_count; i++) {
+                int x = a[i].x1;
+                while (j < b_count && b[j].x2 <= x)
+                    j++;
+                for (int k = j; k < b_count && b[k].x1 < a[i].x2; k++) {
+                    if (b[k].x1 > x)
+                        spans.push_back({x, b[k].x1});
+                    x = std::max(x, b[k].x2);
+                    if (x >= a[i].x2)
+                        break;
+                }
+                if (x < a[i].x2)
+                    spans.push_back({x, a[i].x2});
+            }
+            break;
+    }
+}
+
+// Appends the spans as a band going from y1 to y2,
+// or stretches the previous band down to y2 when it has the exact same spans and ends where this one starts
+static void emit_band(std::vector<Region_Box> &out, int y1, int y2, const std::vector<Span> &spans,
+                      int &previous_band) {
+    if (spans.empty())
+        return;
+
+    int count = spans.size();
+    if (previous_band >= 0 && out[previous_band].y2 == y1 && (int) out.size() - previous_band == count) {
+        bool same = true;
+        for (int k = 0; k < count && same; k++)
+            same = out[previous_band + k].x1 == spans[k].x1 && out[previous_band + k].x2 == spans[k].x2;
+        if (same) {
+            for (int k = 0; k < count; k++)
+                out[previous_band + k].y2 = y2;
+            return;
+        }
+    }
+
+    previous_band = out.size();
+    for (const Span &span : spans)
+        out.push_back({span.x1, y1, span.x2, y2});
+}
+
+static void combine(Region_Op op, const std::vector<Region_Box> &a, const std::vector<Region_Box> &b,
+                    std::vector<Region_Box> &out) {
+    std::vector<Span> spans;
+    int a_count = a.size();
+    int b_count = b.size();
+    int ia = 0;
+    int ib = 0;
+    int a_end = band_end(a, ia);
+    int b_end = band_end(b, ib);
+    int previous_band = -1;
+    int y = INT_MIN;
+
+    while (ia < a_count || ib < b_count) {
+        if (op == INTERSECT && (ia == a_count || ib == b_count))
+            break;
+        if (op == SUBTRACT && ia == a_count)
+            break;
+
+        bool a_active = ia < a_count && a[ia].y1 <= y;
+        bool b_active = ib < b_count && b[ib].y1 <= y;
+        if (!a_active && !b_active) {
+            // Jump straight to where the next band of either region starts
+            y = std::min(ia < a_count ? a[ia].y1 : INT_MAX, ib < b_count ? b[ib].y1 : INT_MAX);
+            continue;
+        }
+
+        // The strip ends where the next band starts or an active band stops, whichever comes first
+        int next_y = INT_MAX;
+        if (ia < a_count)
+            next_y = std::min(next_y, a_active ? a[ia].y2 : a[ia].y1);
+        if (ib < b_count)
+            next_y = std::min(next_y, b_active ? b[ib].y2 : b[ib].y1);
+
+        spans.clear();
+        combine_spans(op,
+                      a_active ? &a[ia] : nullptr, a_active ? a_end - ia : 0,
+                      b_active ? &b[ib] : nullptr, b_active ? b_end - ib : 0,
+                      spans);
+        emit_band(out, y, next_y, spans, previous_band);
+
+        y = next_y;
+        if (ia < a_count && a[ia].y2 <= y) {
+            ia = a_end;
+            a_end = band_end(a, ia);
+        }
+        if (ib < b_count && b[ib].y2 <= y) {
+            ib = b_end;
+            b_end = band_end(b, ib);
+        }
+    }
+}
+
+Banded_Region::Banded_Region(const Region_Box &box) {
+    if (box.x1 < box.x2 && box.y1 < box.y2) {
+        boxes.push_back(box);
+        bounds = box;
+    }
+}
+
+Banded_Region::Banded_Region(int x, int y, int width, int height)
+        : Banded_Region(Region_Box{x, y, x + width, y + height}) {
+}
+
+Banded_Region Banded_Region::from_rectangles(const XRectangle *rectangles, int count) {
+    // We merge the rectangles pairwise, like a merge sort,
+    // so we don't end up repeatedly merging one small rectangle into a big region
+    std::vector<Banded_Region> regions;
+    regions.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const XRectangle &r = rectangles[i];
+        regions.emplace_back(r.x, r.y, r.width, r.height);
+    }
+    while (regions.size() > 1) {
+        size_t merged = 0;
+        for (size_t i = 0; i < regions.size(); i += 2) {
+            if (i + 1 < regions.size())
+                regions[i].unite(regions[i + 1]);
+            std::swap(regions[merged++], regions[i]);
+        }
+        regions.resize(merged);
+    }
+    if (regions.empty())
+        return Banded_Region();
+    return regions[0];
+}
+
+long Banded_Region::area() const {
+    long total = 0;
+    for (const Region_Box &box : boxes)
+        total += (long) (box.x2 - box.x1) * (box.y2 - box.y1);
+    return total;
+}
+
+bool Banded_Region::operator==(const Banded_Region &other) const {
+    if (boxes.size() != other.boxes.size())
+        return false;
+    for (size_t i = 0; i < boxes.size(); i++) {
+        const Region_Box &a = boxes[i];
+        const Region_Box &b = other.boxes[i];
+        if (a.x1 != b.x1 || a.y1 != b.y1 || a.x2 != b.x2 || a.y2 != b.y2)
+            return false;
+    }
+    return true;
+}
+
+bool Banded_Region::contains(const Banded_Region &other) const {
+    if (other.empty())
+        return true;
+    if (empty() || !box_contains(bounds, other.bounds))
+        return false;
+    if (boxes.size() == 1)
+        return true;
+    Banded_Region outside = other;
+    outside.subtract(*this);
+    return outside.empty();
+}
+
+void Banded_Region::clear() {
+    boxes.clear();
+    bounds = {0, 0, 0, 0};
+}
+
+void Banded_Region::translate(int dx, int dy) {
+    if (empty())
+        return;
+    for (Region_Box &box : boxes) {
+        box.x1 += dx;
+        box.y1 += dy;
+        box.x2 += dx;
+        box.y2 += dy;
+    }
+    bounds.x1 += dx;
+    bounds.y1 += dy;
+    bounds.x2 += dx;
+    bounds.y2 += dy;
+}
+
+void Banded_Region::unite(const Banded_Region &other) {
+    if (other.empty())
+        return;
+    if (empty() || (other.boxes.size() == 1 && box_contains(other.bounds, bounds))) {
+        *this = other;
+        return;
+    }
+    if (boxes.size() == 1 && box_contains(bounds, other.bounds))
+        return;
+
+    std::vector<Region_Box> result;
+    result.reserve(boxes.size() + other.boxes.size());
+    combine(UNITE, boxes, other.boxes, result);
+    boxes.swap(result);
+    update_bounds();
+}
+
+void Banded_Region::subtract(const Banded_Region &other) {
+    if (empty() || other.empty() || !boxes_overlap(bounds, other.bounds))
+        return;
+    if (other.boxes.size() == 1 && box_contains(other.bounds, bounds)) {
+        clear();
+        return;
+    }
+
+    std::vector<Region_Box> result;
+    result.reserve(boxes.size() + other.boxes.size() * 2);
+    combine(SUBTRACT, boxes, other.boxes, result);
+    boxes.swap(result);
+    update_bounds();
+}
+
+void Banded_Region::intersect(const Banded_Region &other) {
+    if (empty() || other.empty() || !boxes_overlap(bounds, other.bounds)) {
+        clear();
+        return;
+    }
+    if (other.boxes.size() == 1 && box_contains(other.bounds, bounds))
+        return;
+    if (boxes.size() == 1 && box_contains(bounds, other.bounds)) {
+        *this = other;
+        return;
+    }
+
+    std::vector<Region_Box> result;
+    result.reserve(boxes.size() + other.boxes.size());
+    combine(INTERSECT, boxes, other.boxes, result);
+    boxes.swap(result);
+    update_bounds();
+}
+
+static long box_area(const Region_Box &box) {
+    return (long) (box.x2 - box.x1) * (box.y2 - box.y1);
+}
+
+static Region_Box box_union(const Region_Box &a, const Region_Box &b) {
+    return {std::min(a.x1, b.x1), std::min(a.y1, b.y1), std::max(a.x2, b.x2), std::max(a.y2, b.y2)};
+}
+
+bool Banded_Region::simplify(int max_boxes, long box_cost) {
+    if (boxes.size() <= 1)
+        return false;
+    long exact_cost = area() + (long) boxes.size() * box_cost;
+    // Mostly filled in, or so few pixels that it doesn't matter
+    if (box_area(bounds) + box_cost <= exact_cost) {
+        *this = Banded_Region(bounds);
+        return true;
+    }
+    if ((int) boxes.size() <= max_boxes)
+        return false;
+
+    // Every box goes into the group whose bounding box grows the least by taking it in,
+    // unless that adds more pixels than a group of its own would cost.
+    // The boxes come sorted top to bottom, so the groups grow down the screen like the damage does.
+    //
+    std::vector<Region_Box> groups;
+    for (const Region_Box &box : boxes) {
+        int best = -1;
+        long best_growth = 0;
+        for (size_t i = 0; i < groups.size(); i++) {
+            long growth = box_area(box_union(groups[i], box)) - box_area(groups[i]) - box_area(box);
+            if (best < 0 || growth < best_growth) {
+                best = i;
+                best_growth = growth;
+            }
+        }
+        if (best >= 0 && (best_growth <= box_cost || (int) groups.size() == max_boxes))
+            groups[best] = box_union(groups[best], box);
+        else
+            groups.push_back(box);
+    }
+    // Groups that ended up overlapping would be cut up again when we band them, so they become one
+    // (and a group that grew can reach one it was already checked against, so we go until nothing merges)
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < groups.size(); i++) {
+            for (size_t j = i + 1; j < groups.size(); j++) {
+                if (boxes_overlap(groups[i], groups[j])) {
+                    groups[i] = box_union(groups[i], groups[j]);
+                    groups.erase(groups.begin() + j);
+                    j--;
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    long grouped_cost = (long) groups.size() * box_cost;
+    for (const Region_Box &group : groups)
+        grouped_cost += box_area(group);
+    if (grouped_cost >= exact_cost)
+        return false;
+    Banded_Region grouped;
+    for (const Region_Box &group : groups)
+        grouped.unite(Banded_Region(group));
+    *this = grouped;
+    return true;
+}
+
+void Banded_Region::to_rectangles(std::vector<XRectangle> &out) const {
+    out.resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        const Region_Box &box = boxes[i];
+        out[i].x = std::max(box.x1, SHRT_MIN);
+        out[i].y = std::max(box.y1, SHRT_MIN);
+        out[i].width = std::min(box.x2 - out[i].x, USHRT_MAX);
+        out[i].height = std::min(box.y2 - out[i].y, USHRT_MAX);
+    }
+}
+
+void Banded_Region::update_bounds() {
+    if (boxes.empty()) {
+        bounds = {0, 0, 0, 0};
+        return;
+    }
+    bounds.y1 = boxes.front().y1;
+    bounds.y2 = boxes.back().y2;
+    bounds.x1 = INT_MAX;
+    bounds.x2 = INT_MIN;
+    for (const Region_Box &box : boxes) {
+        bounds.x1 = std::min(bounds.x1, box.x1);
+        bounds.x2 = std::max(bounds.x2, box.x2);
+    }
+}
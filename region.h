@@ -0,0 +1,92 @@
+#ifndef XCOMPMGR_SIMPLE_REGION_H
+#define XCOMPMGR_SIMPLE_REGION_H
+
+#include <X11/Xlib.h>
+
+#include <vector>
+
+// A rectangle going from (x1, y1) up to but not including (x2, y2)
+struct Region_Box {
+    int x1, y1, x2, y2;
+};
+
+// An area of the screen made out of rectangles, kept entirely on our side of the connection.
+//
+// XFixes regions live on the server, so every union, subtract, or intersect is a request
+// and we can't even look at the result without a round trip.
+// Doing the math ourselves means the server only ever gets to see the final list of rectangles,
+// when we hand it to XRenderSetPictureClipRectangles.
+//
+// The rectangles are stored the same way pixman and the X server store them (y-x banded):
+//     - they are sorted by y1 and then by x1
+//     - rectangles that share a y1 form a band, and every rectangle in a band has the same y2
+//     - bands and rectangles inside a band never overlap or touch
+//     - two bands on top of each other that have the exact same rectangles are merged into one
+// This keeps the representation unique, so two regions covering the same area have equal box lists.
+//
+class Banded_Region {
+public:
+    Banded_Region() = default;
+
+    explicit Banded_Region(const Region_Box &box);
+
+    Banded_Region(int x, int y, int width, int height);
+
+    // Builds a region out of rectangles which may overlap and come in any order
+    static Banded_Region from_rectangles(const XRectangle *rectangles, int count);
+
+    bool empty() const {
+        return boxes.empty();
+    }
+
+    // The smallest box that contains the whole region
+    const Region_Box &extents() const {
+        return bounds;
+    }
+
+    const std::vector<Region_Box> &box_list() const {
+        return boxes;
+    }
+
+    int box_count() const {
+        return boxes.size();
+    }
+
+    long area() const;
+
+    // Whether every pixel of other is in the region too, an empty other always is
+    bool contains(const Banded_Region &other) const;
+
+    bool operator==(const Banded_Region &other) const;
+
+    void clear();
+
+    void translate(int dx, int dy);
+
+    // this = this + other
+    void unite(const Banded_Region &other);
+
+    // this = this - other
+    void subtract(const Banded_Region &other);
+
+    // this = the part of this that is also in other
+    void intersect(const Banded_Region &other);
+
+    // Trades exactness for fewer rectangles: replaces the region with a few boxes that cover it
+    // when painting the extra pixels is estimated to cost less than the rectangles saved.
+    // box_cost is what one more rectangle costs, in pixels painted.
+    // The extents alone are tried first, and past max_boxes rectangles the region is grouped into at most
+    // max_boxes bounding boxes. Returns whether the region changed, it never gets smaller.
+    bool simplify(int max_boxes, long box_cost);
+
+    // Fills out with the rectangles of the region, the way XRender and XFixes want them
+    void to_rectangles(std::vector<XRectangle> &out) const;
+
+private:
+    std::vector<Region_Box> boxes;
+    Region_Box bounds = {0, 0, 0, 0};
+
+    void update_bounds();
+};
+
+#endif
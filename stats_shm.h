@@ -0,0 +1,135 @@
+#ifndef XCOMPMGR_SIMPLE_STATS_SHM_H
+#define XCOMPMGR_SIMPLE_STATS_SHM_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// The compositor publishes what it did in every frame into a piece of shared memory,
+// so that xcompmgr-simple-stats (tools/stats.cpp) can watch a running compositor without slowing it down.
+//
+// The frames go into a ring buffer. There's only ever one writer (the compositor)
+// so nothing needs a lock: every record carries a sequence number that is odd while the record is being written.
+// A reader copies the record and then checks the sequence number is even and didn't change while it was copying,
+// and if it did, it just tries again.
+//
+const uint32_t stats_magic = 0x78637374;
+const uint32_t stats_version = 5;
+const int stats_ring_size = 512;
+const int stats_event_types = 128; // event types are 7 bits, the top bit only says the event was sent by a client
+const int stats_top_clients = 16;
+
+struct Frame_Stats {
+    uint64_t frame;
+    uint64_t timestamp_us; // CLOCK_MONOTONIC when the frame was painted
+    uint32_t paint_us; // how long paint_all took on our side (the server does its part later)
+    uint32_t events; // events processed since the previous frame
+    uint32_t damage_events; // DamageNotify events received
+    uint32_t damage_subtracts; // XDamageSubtract requests sent, at most one per damaged window
+    uint32_t damage_collapses; // windows whose damage got too complex and was replaced by their extents
+    // Banded_Regions our region math built: every add_damage and damage simplification,
+    // and the border_size, extents and border_clip of every window the occlusion pass looked at
+    uint32_t regions_computed;
+    // XFixes regions we had the server make, which only happens with -P: the update region of every XPresentPixmap,
+    // and the empty shapes that hide the overlay window (set up, and a window unredirected)
+    uint32_t server_regions_created;
+    uint32_t composites; // XRenderComposite requests
+    uint32_t requests;
+    uint32_t round_trips;
+    uint32_t live_pixmaps;
+    uint32_t live_pictures;
+    uint32_t live_clients;
+    uint64_t composited_pixels; // how many pixels those composites were allowed to touch
+};
+
+struct Client_Damage_Stats {
+    uint32_t window;
+    uint32_t damage_events;
+    uint32_t deferrals; // times its damage was held back for a later frame (see acknowledge_damage)
+};
+
+struct Stats_Frame_Slot {
+    std::atomic<uint64_t> sequence;
+    Frame_Stats stats;
+};
+
+struct Stats_Shm {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t pid;
+    std::atomic<uint64_t> frames_written;
+    std::atomic<uint64_t> events_by_type[stats_event_types]; // since the compositor started
+
+    // The clients that sent the most damage events in the last second, most first (see update_damage_rates)
+    std::atomic<uint64_t> top_clients_sequence;
+    Client_Damage_Stats top_clients[stats_top_clients];
+
+    Stats_Frame_Slot ring[stats_ring_size];
+};
+
+// The shared memory object for a display, so compositors on different displays don't fight over it
+inline void stats_shm_name(const char *display_name, char *name, size_t size) {
+    snprintf(name, size, "/xcompmgr-simple-%s", display_name ? display_name : "");
+    for (char *c = name + 1; *c; c++) {
+        if (*c == '/' || *c == ':')
+            *c = '_';
+    }
+}
+
+// Only the single writer may call this, which is why a plain load and store is enough
+inline void stats_increment(std::atomic<uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+inline void stats_write_frame(Stats_Shm *shm, const Frame_Stats &stats) {
+    uint64_t index = shm->frames_written.load(std::memory_order_relaxed);
+    Stats_Frame_Slot &slot = shm->ring[index % stats_ring_size];
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&slot.stats, &stats, sizeof(stats));
+    slot.stats.frame = index;
+    slot.sequence.store(sequence + 2, std::memory_order_release);
+    shm->frames_written.store(index + 1, std::memory_order_release);
+}
+
+inline void stats_write_top_clients(Stats_Shm *shm, const Client_Damage_Stats *clients, int count) {
+    uint64_t sequence = shm->top_clients_sequence.load(std::memory_order_relaxed);
+    shm->top_clients_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memset(shm->top_clients, 0, sizeof(shm->top_clients));
+    memcpy(shm->top_clients, clients, sizeof(Client_Damage_Stats) * count);
+    shm->top_clients_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Returns false when the frame was already overwritten, or is being written right now
+inline bool stats_read_frame(const Stats_Shm *shm, uint64_t index, Frame_Stats *stats) {
+    const Stats_Frame_Slot &slot = shm->ring[index % stats_ring_size];
+    for (int attempt = 0; attempt < 100; attempt++) {
+        uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+        memcpy(stats, &slot.stats, sizeof(*stats));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == before)
+            return stats->frame == index;
+    }
+    return false;
+}
+
+inline bool stats_read_top_clients(const Stats_Shm *shm, Client_Damage_Stats *clients) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        uint64_t before = shm->top_clients_sequence.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+        memcpy(clients, shm->top_clients, sizeof(shm->top_clients));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shm->top_clients_sequence.load(std::memory_order_relaxed) == before)
+            return true;
+    }
+    return false;
+}
+
+#endif
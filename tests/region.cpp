@@ -0,0 +1,302 @@
+// Checks Banded_Region against a bitmap of the same pixels.
+//
+// Random regions are built out of random rectangles on a small grid, so that they overlap a lot,
+// and pushed through unite, subtract, intersect and translate, with every result compared to doing
+// the same thing one pixel at a time. Every result also has to be in the banded form the operations rely on:
+//     - boxes go top to bottom, and left to right inside a band, and all the boxes of a band have the same y1 and y2
+//     - boxes in a band don't touch, and a band doesn't touch the one above it with the same spans (they'd be one band)
+//     - extents is the bounding box, and area the number of pixels
+// contains and operator== are checked against the bitmaps as well, and simplify against contains.
+//
+// When there is an X server with XFixes (DISPLAY), the same operations are also done on server regions
+// and have to come out the same. Without one that part is skipped.
+//
+// Prints one line per part and exits with 1 on the first thing that doesn't match.
+//
+
+#include "region.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+// The rectangles are placed in [0, grid), translate moves them by up to grid / 2 either way
+const int grid = 48;
+const int margin = grid;
+const int bitmap_size = grid + margin * 2;
+const int rounds = 20000;
+
+struct Bitmap {
+    std::vector<char> pixels = std::vector<char>(bitmap_size * bitmap_size);
+
+    char &at(int x, int y) {
+        return pixels[(y + margin) * bitmap_size + x + margin];
+    }
+
+    void fill(const Region_Box &box, char value) {
+        for (int y = box.y1; y < box.y2; y++)
+            for (int x = box.x1; x < box.x2; x++)
+                at(x, y) = value;
+    }
+};
+
+static void fail(const char *test, int round, const char *what) {
+    fprintf(stderr, "test=%s round=%d %s\n", test, round, what);
+    exit(1);
+}
+
+static Bitmap to_bitmap(const Banded_Region &region) {
+    Bitmap bitmap;
+    for (const Region_Box &box : region.box_list())
+        bitmap.fill(box, 1);
+    return bitmap;
+}
+
+static void check_banded(const char *test, int round, const Banded_Region &region) {
+    const std::vector<Region_Box> &boxes = region.box_list();
+    Region_Box bounds = {0, 0, 0, 0};
+    long area = 0;
+    size_t previous_band = 0;
+    size_t band = 0;
+    for (size_t i = 0; i < boxes.size(); i++) {
+        const Region_Box &box = boxes[i];
+        if (box.x1 >= box.x2 || box.y1 >= box.y2)
+            fail(test, round, "empty box");
+        if (i > band && box.y1 != boxes[band].y1) {
+            previous_band = band;
+            band = i;
+        }
+        if (i > band) {
+            if (box.y2 != boxes[band].y2)
+                fail(test, round, "boxes of a band with different heights");
+            if (box.x1 <= boxes[i - 1].x2)
+                fail(test, round, "boxes of a band out of order or touching");
+        }
+        if (band > 0 && i == band) {
+            if (box.y1 < boxes[previous_band].y2)
+                fail(test, round, "bands out of order or overlapping");
+        }
+        if (i == 0) {
+            bounds = box;
+        } else {
+            bounds.x1 = std::min(bounds.x1, box.x1);
+            bounds.x2 = std::max(bounds.x2, box.x2);
+            bounds.y2 = box.y2;
+        }
+        area += (long) (box.x2 - box.x1) * (box.y2 - box.y1);
+    }
+
+    // Two bands on top of each other with the same spans should have been one
+    size_t start = 0;
+    while (start < boxes.size()) {
+        size_t end = start;
+        while (end < boxes.size() && boxes[end].y1 == boxes[start].y1)
+            end++;
+        size_t next_end = end;
+        while (next_end < boxes.size() && boxes[next_end].y1 == boxes[end].y1)
+            next_end++;
+        if (end < boxes.size() && boxes[end].y1 == boxes[start].y2 && next_end - end == end - start) {
+            bool same = true;
+            for (size_t k = 0; k < end - start && same; k++)
+                same = boxes[start + k].x1 == boxes[end + k].x1 && boxes[start + k].x2 == boxes[end + k].x2;
+            if (same)
+                fail(test, round, "bands that should have been merged");
+        }
+        start = end;
+    }
+
+    const Region_Box &extents = region.extents();
+    if (extents.x1 != bounds.x1 || extents.y1 != bounds.y1 || extents.x2 != bounds.x2 || extents.y2 != bounds.y2)
+        fail(test, round, "wrong extents");
+    if (region.area() != area)
+        fail(test, round, "wrong area");
+    if (region.empty() != boxes.empty())
+        fail(test, round, "wrong empty");
+}
+
+static void check(const char *test, int round, const Banded_Region &region, const Bitmap &expected) {
+    check_banded(test, round, region);
+    if (to_bitmap(region).pixels != expected.pixels)
+        fail(test, round, "pixels differ from the bitmap");
+}
+
+static std::vector<XRectangle> random_rectangles(std::mt19937 &random) {
+    std::vector<XRectangle> rectangles(1 + random() % 8);
+    for (XRectangle &r : rectangles) {
+        r.x = random() % grid;
+        r.y = random() % grid;
+        // Sometimes empty, which has to be left out
+        r.width = random() % (grid - r.x + 1);
+        r.height = random() % (grid - r.y + 1);
+    }
+    return rectangles;
+}
+
+static Bitmap rectangles_bitmap(const std::vector<XRectangle> &rectangles) {
+    Bitmap bitmap;
+    for (const XRectangle &r : rectangles)
+        bitmap.fill({r.x, r.y, r.x + r.width, r.y + r.height}, 1);
+    return bitmap;
+}
+
+static void test_operations() {
+    std::mt19937 random(1);
+    for (int round = 0; round < rounds; round++) {
+        std::vector<XRectangle> a_rectangles = random_rectangles(random);
+        std::vector<XRectangle> b_rectangles = random_rectangles(random);
+        Banded_Region a = Banded_Region::from_rectangles(a_rectangles.data(), a_rectangles.size());
+        Banded_Region b = Banded_Region::from_rectangles(b_rectangles.data(), b_rectangles.size());
+        Bitmap a_bitmap = rectangles_bitmap(a_rectangles);
+        Bitmap b_bitmap = rectangles_bitmap(b_rectangles);
+        check("from_rectangles", round, a, a_bitmap);
+        check("from_rectangles", round, b, b_bitmap);
+
+        Bitmap expected;
+        bool a_contains_b = true;
+        bool same = true;
+        for (size_t i = 0; i < expected.pixels.size(); i++) {
+            if (b_bitmap.pixels[i] && !a_bitmap.pixels[i])
+                a_contains_b = false;
+            if (a_bitmap.pixels[i] != b_bitmap.pixels[i])
+                same = false;
+        }
+        if (a.contains(b) != a_contains_b)
+            fail("contains", round, "wrong answer");
+        if (!a.contains(a) || !a.contains(Banded_Region()))
+            fail("contains", round, "doesn't contain itself or nothing");
+        // There's only one way to band a set of pixels
+        if ((a == b) != same)
+            fail("equal", round, "wrong answer");
+
+        Banded_Region united = a;
+        united.unite(b);
+        for (size_t i = 0; i < expected.pixels.size(); i++)
+            expected.pixels[i] = a_bitmap.pixels[i] | b_bitmap.pixels[i];
+        check("unite", round, united, expected);
+        if (!united.contains(a) || !united.contains(b))
+            fail("contains", round, "union doesn't contain its parts");
+
+        Banded_Region subtracted = a;
+        subtracted.subtract(b);
+        for (size_t i = 0; i < expected.pixels.size(); i++)
+            expected.pixels[i] = a_bitmap.pixels[i] & !b_bitmap.pixels[i];
+        check("subtract", round, subtracted, expected);
+
+        Banded_Region intersected = a;
+        intersected.intersect(b);
+        for (size_t i = 0; i < expected.pixels.size(); i++)
+            expected.pixels[i] = a_bitmap.pixels[i] & b_bitmap.pixels[i];
+        check("intersect", round, intersected, expected);
+        if (!b.contains(intersected))
+            fail("contains", round, "intersection isn't in both");
+
+        int dx = (int) (random() % grid) - grid / 2;
+        int dy = (int) (random() % grid) - grid / 2;
+        Banded_Region translated = united;
+        translated.translate(dx, dy);
+        Bitmap united_bitmap = to_bitmap(united);
+        expected = Bitmap();
+        for (int y = 0; y < grid; y++)
+            for (int x = 0; x < grid; x++)
+                expected.at(x + dx, y + dy) = united_bitmap.at(x, y);
+        check("translate", round, translated, expected);
+
+        Banded_Region simplified = subtracted;
+        int max_boxes = 1 + random() % 4;
+        bool changed = simplified.simplify(max_boxes, random() % 64);
+        check_banded("simplify", round, simplified);
+        if (!simplified.contains(subtracted))
+            fail("simplify", round, "lost pixels");
+        if (!changed && !(simplified == subtracted))
+            fail("simplify", round, "changed without saying so");
+    }
+    printf("test=bitmap rounds=%d ok\n", rounds);
+}
+
+static XserverRegion server_region(Display *display, const Banded_Region &region) {
+    std::vector<XRectangle> rectangles;
+    region.to_rectangles(rectangles);
+    return XFixesCreateRegion(display, rectangles.data(), rectangles.size());
+}
+
+static Banded_Region fetch_region(Display *display, XserverRegion region) {
+    int count = 0;
+    XRectangle *rectangles = XFixesFetchRegion(display, region, &count);
+    Banded_Region result = Banded_Region::from_rectangles(rectangles, count);
+    XFree(rectangles);
+    return result;
+}
+
+static void test_xfixes() {
+    Display *display = XOpenDisplay(nullptr);
+    int event_base, error_base;
+    if (!display || !XFixesQueryExtension(display, &event_base, &error_base)) {
+        printf("test=xfixes skipped, no X server with XFixes\n");
+        if (display)
+            XCloseDisplay(display);
+        return;
+    }
+
+    std::mt19937 random(2);
+    const int server_rounds = rounds / 10;
+    for (int round = 0; round < server_rounds; round++) {
+        std::vector<XRectangle> a_rectangles = random_rectangles(random);
+        std::vector<XRectangle> b_rectangles = random_rectangles(random);
+        Banded_Region a = Banded_Region::from_rectangles(a_rectangles.data(), a_rectangles.size());
+        Banded_Region b = Banded_Region::from_rectangles(b_rectangles.data(), b_rectangles.size());
+        XserverRegion server_a = XFixesCreateRegion(display, a_rectangles.data(), a_rectangles.size());
+        XserverRegion server_b = XFixesCreateRegion(display, b_rectangles.data(), b_rectangles.size());
+        XserverRegion server_result = XFixesCreateRegion(display, nullptr, 0);
+
+        if (!(fetch_region(display, server_a) == a))
+            fail("xfixes_create", round, "differs from the server");
+
+        Banded_Region result = a;
+        result.unite(b);
+        XFixesUnionRegion(display, server_result, server_a, server_b);
+        if (!(fetch_region(display, server_result) == result))
+            fail("xfixes_unite", round, "differs from the server");
+
+        result = a;
+        result.subtract(b);
+        XFixesSubtractRegion(display, server_result, server_a, server_b);
+        if (!(fetch_region(display, server_result) == result))
+            fail("xfixes_subtract", round, "differs from the server");
+
+        result = a;
+        result.intersect(b);
+        XFixesIntersectRegion(display, server_result, server_a, server_b);
+        if (!(fetch_region(display, server_result) == result))
+            fail("xfixes_intersect", round, "differs from the server");
+
+        int dx = (int) (random() % grid) - grid / 2;
+        int dy = (int) (random() % grid) - grid / 2;
+        result = a;
+        result.translate(dx, dy);
+        XFixesTranslateRegion(display, server_a, dx, dy);
+        if (!(fetch_region(display, server_a) == result))
+            fail("xfixes_translate", round, "differs from the server");
+
+        // And what we send the server has to be the same region
+        XserverRegion sent = server_region(display, result);
+        if (!(fetch_region(display, sent) == result))
+            fail("xfixes_to_rectangles", round, "differs from the server");
+
+        XFixesDestroyRegion(display, sent);
+        XFixesDestroyRegion(display, server_a);
+        XFixesDestroyRegion(display, server_b);
+        XFixesDestroyRegion(display, server_result);
+    }
+    printf("test=xfixes rounds=%d ok\n", server_rounds);
+    XCloseDisplay(display);
+}
+
+int main() {
+    test_operations();
+    test_xfixes();
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef XCOMPMGR_SIMPLE_THUMBNAIL_H
+#define XCOMPMGR_SIMPLE_THUMBNAIL_H
+
+#include <stdint.h>
+
+// Thumbnails of windows for other programs (-L socket), so a taskbar or a window switcher
+// doesn't have to redirect every window a second time and read it at full size to show a preview.
+//
+// Connect a SOCK_SEQPACKET unix socket to the path given to -L and send a Thumbnail_Request,
+// the answer is a Thumbnail_Reply with the id of a pixmap on the X server that holds the window scaled down
+// to fit in max_width x max_height (never scaled up). It's depth 32, premultiplied ARGB like an ARGB window,
+// and it's done being drawn into by the time the reply comes, so it can be read or composited right away
+// (xcompmgr-simple-thumbnail, tools/thumbnail.cpp, writes one out to a file).
+//
+// The compositor keeps one thumbnail per window, shared by everyone who asks.
+// It's only drawn again when asked for after the window was damaged, or at a different size,
+// so asking for the same window over and over costs nothing while it doesn't change.
+// The pixmap is the compositor's: it stays the same until the thumbnail has to change size,
+// and is freed when the window is destroyed. A window that is unmapped (minimized) keeps the last one it had.
+//
+const uint32_t thumbnail_socket_version = 1;
+
+struct Thumbnail_Request {
+    uint32_t version; // thumbnail_socket_version
+    uint32_t window; // a child of the root, the frame the window manager put around a window
+    uint16_t max_width;
+    uint16_t max_height;
+};
+
+enum Thumbnail_Status {
+    THUMBNAIL_OK = 0,
+    THUMBNAIL_UNKNOWN_WINDOW, // not a child of the root, or gone
+    THUMBNAIL_NOT_SHOWN, // hasn't been shown yet, so there's nothing to make a thumbnail of
+    THUMBNAIL_BAD_REQUEST, // a different version, or a max size of 0
+};
+
+struct Thumbnail_Reply {
+    uint32_t window;
+    uint32_t pixmap;
+    uint16_t width;
+    uint16_t height;
+    uint8_t status; // Thumbnail_Status
+    uint8_t refreshed; // 1 when it was drawn again for this request
+    uint16_t unused;
+};
+
+#endif
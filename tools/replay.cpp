@@ -0,0 +1,326 @@
+// xcompmgr-simple-replay: plays an event record (xcompmgr-simple -E, see event_record.h) back on a display
+//
+// Every recorded window gets a stand in with the same geometry, depth, shape, and opacity,
+// and the events are turned back into the requests that cause them: maps, moves, restacks,
+// and a rectangle filled in wherever the window was damaged.
+// Point it at an Xvfb with the compositor under test running on it, and the compositor sees
+// the same stream of events it saw when the session was recorded:
+//     Xvfb :5 -screen 0 1920x1080x24 &
+//     DISPLAY=:5 ./xcompmgr-simple -s &
+//     DISPLAY=:5 ./xcompmgr-simple-replay -x session.rec
+//
+// It plays at the recorded speed, or with -x as fast as the server takes it.
+// What the windows actually drew isn't recorded, so the stand ins draw solid colors.
+//
+
+#include "event_record.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/shape.h>
+
+Display *display;
+Window root;
+Event_Record_Header header;
+struct Stand_In {
+    Window window;
+    bool argb;
+};
+std::unordered_map<uint32_t, Stand_In> windows; // recorded window -> its stand in
+GC solid_gc; // for the 24 bit windows
+GC argb_gc; // for the 32 bit windows, created with the first one
+Visual *argb_visual;
+Colormap argb_colormap;
+Atom opacity_atom;
+unsigned long errors;
+
+static uint64_t monotonic_us() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+    timespec duration;
+    duration.tv_sec = us / 1000000;
+    duration.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&duration, nullptr);
+}
+
+// Plenty of requests are about windows that are already gone, just like in the recorded session
+static int count_error(Display *, XErrorEvent *) {
+    errors++;
+    return 0;
+}
+
+static std::vector<Event_Record> read_records(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    if (!event_record_read_header(file, &header)) {
+        fprintf(stderr, "%s isn't an event record, or is from a different version of the compositor\n", path);
+        exit(1);
+    }
+    std::vector<Event_Record> records;
+    Event_Record record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+        records.push_back(record);
+    fclose(file);
+    return records;
+}
+
+// A window only shows its depth in the RECORD_WINDOW that comes after its CreateNotify (or ReparentNotify),
+// so we copy it over to the record that creates it
+static void find_depths(std::vector<Event_Record> &records) {
+    std::unordered_map<uint32_t, size_t> created;
+    for (size_t i = 0; i < records.size(); i++) {
+        const Event_Record &record = records[i];
+        if (record.type == RECORD_CREATE || (record.type == RECORD_REPARENT && record.sibling == header.root_window)) {
+            created[record.window] = i;
+        } else if (record.type == RECORD_WINDOW) {
+            auto found = created.find(record.window);
+            if (found != created.end()) {
+                records[found->second].flags |= record.flags & (RECORD_ARGB | RECORD_INPUT_ONLY);
+                created.erase(found);
+            }
+        }
+    }
+}
+
+static void set_opacity(Window window, unsigned int level) {
+    if (level >= 255) {
+        XDeleteProperty(display, window, opacity_atom);
+        return;
+    }
+    unsigned long opacity = level * 0x01010101u;
+    XChangeProperty(display, window, opacity_atom, XA_CARDINAL, 32, PropModeReplace, (unsigned char *) &opacity, 1);
+}
+
+static Window create_window(const Event_Record &record) {
+    XSetWindowAttributes attributes;
+    attributes.override_redirect = (record.flags & RECORD_OVERRIDE_REDIRECT) != 0;
+    int width = std::max<int>(record.width, 1);
+    int height = std::max<int>(record.height, 1);
+    Window window;
+    bool argb = false;
+    if (record.flags & RECORD_INPUT_ONLY) {
+        window = XCreateWindow(display, root, record.x, record.y, width, height, 0, 0, InputOnly,
+                               CopyFromParent, CWOverrideRedirect, &attributes);
+    } else if ((record.flags & RECORD_ARGB) && argb_visual) {
+        attributes.colormap = argb_colormap;
+        attributes.border_pixel = 0;
+        attributes.background_pixel = 0x80808080;
+        window = XCreateWindow(display, root, record.x, record.y, width, height, record.border_width, 32,
+                               InputOutput, argb_visual,
+                               CWOverrideRedirect | CWColormap | CWBorderPixel | CWBackPixel, &attributes);
+        if (!argb_gc)
+            argb_gc = XCreateGC(display, window, 0, nullptr);
+        argb = true;
+    } else {
+        window = XCreateSimpleWindow(display, root, record.x, record.y, width, height, record.border_width,
+                                     0, 0x404040);
+        XChangeWindowAttributes(display, window, CWOverrideRedirect, &attributes);
+    }
+    windows[record.window] = {window, argb};
+    return window;
+}
+
+static void replay(const Event_Record &record) {
+    auto found = windows.find(record.window);
+    Window window = found != windows.end() ? found->second.window : 0;
+    static unsigned long color = 0;
+
+    switch (record.type) {
+        case RECORD_WINDOW:
+            // Windows that existed before the recording started show up only like this
+            if (!window) {
+                window = create_window(record);
+                if (record.value != 255)
+                    set_opacity(window, record.value);
+                if (record.flags & RECORD_VIEWABLE)
+                    XMapWindow(display, window);
+            } else {
+                XMoveResizeWindow(display, window, record.x, record.y,
+                                  std::max<int>(record.width, 1), std::max<int>(record.height, 1));
+                set_opacity(window, record.value);
+            }
+            break;
+        case RECORD_CREATE:
+            if (!window)
+                create_window(record);
+            break;
+        case RECORD_DESTROY:
+            if (window) {
+                XDestroyWindow(display, window);
+                windows.erase(found);
+            }
+            break;
+        case RECORD_MAP:
+            if (window)
+                XMapWindow(display, window);
+            break;
+        case RECORD_UNMAP:
+            if (window)
+                XUnmapWindow(display, window);
+            break;
+        case RECORD_CONFIGURE: {
+            if (!window)
+                break;
+            XWindowChanges changes;
+            changes.x = record.x;
+            changes.y = record.y;
+            changes.width = std::max<int>(record.width, 1);
+            changes.height = std::max<int>(record.height, 1);
+            changes.border_width = record.border_width;
+            unsigned int mask = CWX | CWY | CWWidth | CWHeight | CWBorderWidth;
+            auto sibling = windows.find(record.sibling);
+            if (sibling != windows.end()) {
+                changes.sibling = sibling->second.window;
+                changes.stack_mode = Above;
+                mask |= CWSibling | CWStackMode;
+            } else if (!record.sibling) {
+                changes.stack_mode = Below;
+                mask |= CWStackMode;
+            }
+            XConfigureWindow(display, window, mask, &changes);
+            break;
+        }
+        case RECORD_REPARENT:
+            // Into a frame is as good as gone for the compositor, back onto the root is a new window
+            if (record.sibling == header.root_window) {
+                if (!window)
+                    create_window(record);
+            } else if (window) {
+                XDestroyWindow(display, window);
+                windows.erase(found);
+            }
+            break;
+        case RECORD_CIRCULATE:
+            if (window && record.value == PlaceOnTop)
+                XRaiseWindow(display, window);
+            else if (window)
+                XLowerWindow(display, window);
+            break;
+        case RECORD_DAMAGE: {
+            if (!window)
+                break;
+            // A GC only draws into drawables of its own depth
+            GC gc = found->second.argb ? argb_gc : solid_gc;
+            color = color * 1103515245 + 12345;
+            XSetForeground(display, gc, found->second.argb ? (color | 0x80000000) : color);
+            XFillRectangle(display, window, gc, record.x, record.y, record.width, record.height);
+            break;
+        }
+        case RECORD_SHAPE:
+            if (!window)
+                break;
+            if (record.flags & RECORD_SHAPED) {
+                XRectangle bounds = {record.x, record.y, record.width, record.height};
+                XShapeCombineRectangles(display, window, ShapeBounding, 0, 0, &bounds, 1, ShapeSet, Unsorted);
+            } else {
+                XShapeCombineMask(display, window, ShapeBounding, 0, 0, None, ShapeSet);
+            }
+            break;
+        case RECORD_EXPOSE:
+            XClearArea(display, root, record.x, record.y, record.width, record.height, true);
+            break;
+        case RECORD_OPACITY:
+            if (window)
+                set_opacity(window, record.value);
+            break;
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [options] record\n", program);
+    fprintf(stderr, "  -d  display to play it on (default $DISPLAY)\n");
+    fprintf(stderr, "  -x  as fast as possible instead of at the recorded speed\n");
+    fprintf(stderr, "  -s  speed, 2 plays twice as fast as it was recorded (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *display_name = nullptr;
+    bool as_fast_as_possible = false;
+    double speed = 1;
+    int option;
+    while ((option = getopt(argc, argv, "d:xs:h")) != -1) {
+        switch (option) {
+            case 'd':
+                display_name = optarg;
+                break;
+            case 'x':
+                as_fast_as_possible = true;
+                break;
+            case 's':
+                speed = atof(optarg);
+                if (speed <= 0) {
+                    fprintf(stderr, "The speed has to be a positive number\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    std::vector<Event_Record> records = read_records(argv[optind]);
+    find_depths(records);
+
+    display = XOpenDisplay(display_name);
+    if (!display) {
+        fprintf(stderr, "Can't open display %s\n", XDisplayName(display_name));
+        exit(1);
+    }
+    XSetErrorHandler(count_error);
+    root = DefaultRootWindow(display);
+    int screen = DefaultScreen(display);
+    if (DisplayWidth(display, screen) != header.root_width || DisplayHeight(display, screen) != header.root_height)
+        fprintf(stderr, "Warning: recorded on a %dx%d screen, playing on %dx%d\n", header.root_width,
+                header.root_height, DisplayWidth(display, screen), DisplayHeight(display, screen));
+    opacity_atom = XInternAtom(display, "_NET_WM_WINDOW_OPACITY", false);
+    solid_gc = XCreateGC(display, root, 0, nullptr);
+    XVisualInfo info;
+    if (XMatchVisualInfo(display, screen, 32, TrueColor, &info)) {
+        argb_visual = info.visual;
+        argb_colormap = XCreateColormap(display, root, argb_visual, AllocNone);
+    }
+
+    uint64_t start = monotonic_us();
+    for (size_t i = 0; i < records.size(); i++) {
+        const Event_Record &record = records[i];
+        if (!as_fast_as_possible) {
+            uint64_t due = start + (uint64_t) (record.time_us / speed);
+            uint64_t now = monotonic_us();
+            if (now < due) {
+                XFlush(display);
+                sleep_us(due - now);
+            }
+        } else if (i % 4096 == 0) {
+            // Don't get so far ahead that the server is still working through it long after we're done
+            XSync(display, false);
+        }
+        replay(record);
+    }
+    XSync(display, false);
+
+    double seconds = (monotonic_us() - start) / 1e6;
+    double recorded_seconds = records.empty() ? 0 : records.back().time_us / 1e6;
+    printf("records=%zu seconds=%.3f recorded_seconds=%.3f errors=%lu\n",
+           records.size(), seconds, recorded_seconds, errors);
+    XCloseDisplay(display);
+    return 0;
+}
@@ -0,0 +1,154 @@
+// xcompmgr-simple-stats: tails the statistics a running compositor publishes in shared memory (see stats_shm.h)
+//
+// It prints one line for every frame the compositor paints,
+// and once a second the clients that sent the most damage and how many events of each type came in.
+// Reading never blocks or slows down the compositor, if we fall too far behind frames are just skipped.
+//
+
+#include "stats_shm.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *event_names[] = {
+        nullptr, nullptr, "KeyPress", "KeyRelease", "ButtonPress", "ButtonRelease", "MotionNotify",
+        "EnterNotify", "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExpose",
+        "NoExpose", "VisibilityNotify", "CreateNotify", "DestroyNotify", "UnmapNotify", "MapNotify",
+        "MapRequest", "ReparentNotify", "ConfigureNotify", "ConfigureRequest", "GravityNotify",
+        "ResizeRequest", "CirculateNotify", "CirculateRequest", "PropertyNotify", "SelectionClear",
+        "SelectionRequest", "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify",
+        "GenericEvent",
+};
+
+static void sleep_ms(int ms) {
+    timespec duration;
+    duration.tv_sec = ms / 1000;
+    duration.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&duration, nullptr);
+}
+
+static const Stats_Shm *open_stats(const char *display_name) {
+    char name[256];
+    stats_shm_name(display_name, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No compositor statistics for display %s (%s), is the compositor running without -N?\n",
+                display_name, name);
+        exit(1);
+    }
+    void *memory = mmap(nullptr, sizeof(Stats_Shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    const Stats_Shm *shm = (const Stats_Shm *) memory;
+    if (shm->magic != stats_magic || shm->version != stats_version) {
+        fprintf(stderr, "The statistics in %s are from a different version of the compositor\n", name);
+        exit(1);
+    }
+    return shm;
+}
+
+static void print_frame(const Frame_Stats &frame) {
+    printf("frame=%llu time_us=%llu paint_us=%u events=%u damage_events=%u damage_subtracts=%u damage_collapses=%u"
+           " regions_computed=%u server_regions_created=%u composites=%u composited_pixels=%llu requests=%u round_trips=%u live_pixmaps=%u live_pictures=%u live_clients=%u\n",
+           (unsigned long long) frame.frame, (unsigned long long) frame.timestamp_us, frame.paint_us,
+           frame.events, frame.damage_events, frame.damage_subtracts, frame.damage_collapses, frame.regions_computed,
+           frame.server_regions_created, frame.composites,
+           (unsigned long long) frame.composited_pixels, frame.requests, frame.round_trips,
+           frame.live_pixmaps, frame.live_pictures, frame.live_clients);
+}
+
+static void print_summary(const Stats_Shm *shm, uint64_t *previous_events) {
+    Client_Damage_Stats top[stats_top_clients];
+    if (stats_read_top_clients(shm, top)) {
+        printf("top_damage");
+        for (const Client_Damage_Stats &client : top) {
+            if (client.damage_events && client.deferrals)
+                printf(" 0x%x=%u(held_back=%u)", client.window, client.damage_events, client.deferrals);
+            else if (client.damage_events)
+                printf(" 0x%x=%u", client.window, client.damage_events);
+        }
+        printf("\n");
+    }
+
+    printf("events");
+    for (int type = 0; type < stats_event_types; type++) {
+        uint64_t count = shm->events_by_type[type].load(std::memory_order_relaxed);
+        if (count == previous_events[type])
+            continue;
+        const char *name = type < (int) (sizeof(event_names) / sizeof(event_names[0])) ? event_names[type] : nullptr;
+        if (name)
+            printf(" %s=%llu", name, (unsigned long long) (count - previous_events[type]));
+        else
+            printf(" event_%d=%llu", type, (unsigned long long) (count - previous_events[type]));
+        previous_events[type] = count;
+    }
+    printf("\n");
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -d  display the compositor runs on (default $DISPLAY)\n");
+    fprintf(stderr, "  -q  don't print every frame, only the once a second summary\n");
+}
+
+int main(int argc, char **argv) {
+    const char *display_name = getenv("DISPLAY");
+    bool print_frames = true;
+    int option;
+    while ((option = getopt(argc, argv, "d:qh")) != -1) {
+        switch (option) {
+            case 'd':
+                display_name = optarg;
+                break;
+            case 'q':
+                print_frames = false;
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (!display_name) {
+        fprintf(stderr, "No display given and DISPLAY isn't set\n");
+        exit(1);
+    }
+
+    const Stats_Shm *shm = open_stats(display_name);
+    uint64_t previous_events[stats_event_types];
+    for (int type = 0; type < stats_event_types; type++)
+        previous_events[type] = shm->events_by_type[type].load(std::memory_order_relaxed);
+
+    uint64_t next_frame = shm->frames_written.load(std::memory_order_acquire);
+    int ticks = 0;
+    while (true) {
+        if (kill(shm->pid, 0) != 0) {
+            fprintf(stderr, "The compositor (pid %u) exited\n", shm->pid);
+            return 0;
+        }
+
+        uint64_t written = shm->frames_written.load(std::memory_order_acquire);
+        if (written - next_frame > (uint64_t) stats_ring_size) {
+            printf("skipped=%llu\n", (unsigned long long) (written - next_frame - stats_ring_size));
+            next_frame = written - stats_ring_size;
+        }
+        for (; next_frame < written; next_frame++) {
+            Frame_Stats frame;
+            if (stats_read_frame(shm, next_frame, &frame) && print_frames)
+                print_frame(frame);
+        }
+
+        if (++ticks == 10) {
+            print_summary(shm, previous_events);
+            ticks = 0;
+        }
+        fflush(stdout);
+        sleep_ms(100);
+    }
+}
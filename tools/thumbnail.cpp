@@ -0,0 +1,119 @@
+// xcompmgr-simple-thumbnail: asks a running compositor (xcompmgr-simple -L socket) for a window's thumbnail
+//
+// It sends one Thumbnail_Request (see thumbnail.h), reads the pixmap it gets back from the server
+// and writes it out as a PPM, over black where the window is translucent:
+//     ./xcompmgr-simple-thumbnail -s 256 /tmp/thumbnails 0x1e00007 thumbnail.ppm
+// Without a file it only prints the reply, which is all a taskbar needs before compositing the pixmap itself.
+//
+
+#include "thumbnail.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+static const char *status_names[] = {"ok", "unknown_window", "not_shown", "bad_request"};
+
+static Thumbnail_Reply request_thumbnail(const char *path, Window window, int size) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path is too long\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    Thumbnail_Request request = {};
+    request.version = thumbnail_socket_version;
+    request.window = window;
+    request.max_width = size;
+    request.max_height = size;
+    Thumbnail_Reply reply = {};
+    if (send(fd, &request, sizeof(request), 0) != sizeof(request) ||
+        recv(fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        fprintf(stderr, "The compositor didn't answer, is %s its -L socket?\n", path);
+        exit(1);
+    }
+    close(fd);
+    return reply;
+}
+
+static void write_ppm(const char *path, const Thumbnail_Reply &reply) {
+    Display *display = XOpenDisplay(nullptr);
+    if (!display) {
+        fprintf(stderr, "Can't open display %s\n", XDisplayName(nullptr));
+        exit(1);
+    }
+    XImage *image = XGetImage(display, reply.pixmap, 0, 0, reply.width, reply.height, AllPlanes, ZPixmap);
+    if (!image) {
+        fprintf(stderr, "Can't read pixmap 0x%x\n", reply.pixmap);
+        exit(1);
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(file, "P6\n%d %d\n255\n", reply.width, reply.height);
+    // Premultiplied, so the color channels as they are is the window over black
+    for (int y = 0; y < reply.height; y++) {
+        for (int x = 0; x < reply.width; x++) {
+            unsigned long pixel = XGetPixel(image, x, y);
+            unsigned char rgb[3] = {(unsigned char) (pixel >> 16), (unsigned char) (pixel >> 8), (unsigned char) pixel};
+            fwrite(rgb, sizeof(rgb), 1, file);
+        }
+    }
+    fclose(file);
+    XDestroyImage(image);
+    XCloseDisplay(display);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [options] socket window [file.ppm]\n", program);
+    fprintf(stderr, "  -s  the biggest the thumbnail can be on either side (default 256)\n");
+}
+
+int main(int argc, char **argv) {
+    int size = 256;
+    int option;
+    while ((option = getopt(argc, argv, "s:h")) != -1) {
+        switch (option) {
+            case 's':
+                size = atoi(optarg);
+                if (size <= 0 || size > 0xffff) {
+                    fprintf(stderr, "The size has to be between 1 and 65535\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : 1);
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    Window window = strtoul(argv[optind + 1], nullptr, 0);
+    Thumbnail_Reply reply = request_thumbnail(argv[optind], window, size);
+    const char *status = reply.status < sizeof(status_names) / sizeof(status_names[0])
+                         ? status_names[reply.status] : "unknown";
+    printf("window=0x%x status=%s pixmap=0x%x width=%u height=%u refreshed=%u\n",
+           reply.window, status, reply.pixmap, reply.width, reply.height, reply.refreshed);
+    if (reply.status != THUMBNAIL_OK)
+        return 1;
+    if (argc - optind == 3)
+        write_ppm(argv[optind + 2], reply);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+struct Trace_Span {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    const char *arg_name;
+    unsigned long arg;
+    int thread; // so that the event thread and the paint thread (-p) get a track each
+};
+
+bool tracing = false;
+
+static const char *trace_path;
+static std::vector<Trace_Span> spans;
+// spans[spans_recorded % spans.size()] is the next one to be overwritten.
+// Both threads record spans, each one claims its slot with an atomic increment.
+static std::atomic<uint64_t> spans_recorded;
+
+static int current_thread() {
+    static thread_local int thread = syscall(SYS_gettid);
+    return thread;
+}
+
+void trace_open(const char *path, int max_spans) {
+    trace_path = path;
+    spans.resize(max_spans);
+    spans_recorded = 0;
+    tracing = true;
+}
+
+uint64_t trace_now_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_record(const char *name, uint64_t start, const char *arg_name, unsigned long arg) {
+    Trace_Span &span = spans[spans_recorded.fetch_add(1, std::memory_order_relaxed) % spans.size()];
+    span.name = name;
+    span.start = start;
+    span.end = trace_now_ns();
+    span.arg_name = arg_name;
+    span.arg = arg;
+    span.thread = current_thread();
+}
+
+void trace_write() {
+    if (!tracing)
+        return;
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        perror(trace_path);
+        return;
+    }
+
+    int pid = getpid();
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"xcompmgr-simple\"}}",
+            pid, pid);
+
+    uint64_t recorded = spans_recorded.load();
+    uint64_t first = recorded > spans.size() ? recorded - spans.size() : 0;
+    for (uint64_t i = first; i < recorded; i++) {
+        const Trace_Span &span = spans[i % spans.size()];
+        // Timestamps are in microseconds, the fraction keeps the nanoseconds
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+                span.name, pid, span.thread,
+                (unsigned long long) (span.start / 1000), (unsigned) (span.start % 1000),
+                (unsigned long long) ((span.end - span.start) / 1000), (unsigned) ((span.end - span.start) % 1000));
+        if (span.arg_name && strcmp(span.arg_name, "window") == 0)
+            fprintf(file, ",\"args\":{\"window\":\"0x%lx\"}", span.arg);
+        else if (span.arg_name)
+            fprintf(file, ",\"args\":{\"%s\":%lu}", span.arg_name, span.arg);
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    if (first > 0)
+        fprintf(stderr, "Trace buffer was full, only the last %zu spans were written to %s\n", spans.size(), trace_path);
+}
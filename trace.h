@@ -0,0 +1,42 @@
+#ifndef XCOMPMGR_SIMPLE_TRACE_H
+#define XCOMPMGR_SIMPLE_TRACE_H
+
+#include <stdint.h>
+
+// Frame timeline tracing (-t file).
+//
+// Every phase of a frame is recorded as a span with a start and an end time,
+// and when the compositor exits the spans are written out in the Chrome trace format,
+// which chrome://tracing and ui.perfetto.dev can open.
+//
+// All the spans go into a ring buffer that is allocated once when tracing starts,
+// so recording a span never allocates, and a long run keeps the most recent spans.
+// When tracing is off, starting and ending a span is a single branch.
+//
+// Keep in mind most X calls only queue a request, the server does the work after we flush.
+// So the spans show where our time goes, unless the compositor also runs with -S,
+// in which case every request waits for the server and the spans include the server's time too.
+//
+extern bool tracing;
+
+void trace_open(const char *path, int max_spans);
+
+// Writes out everything recorded so far, the compositor calls this when it exits
+void trace_write();
+
+uint64_t trace_now_ns();
+
+inline uint64_t trace_start() {
+    return tracing ? trace_now_ns() : 0;
+}
+
+// name has to be a string literal, only the pointer gets stored.
+// arg_name/arg are shown with the span, arg_name == "window" prints arg as a window id.
+void trace_record(const char *name, uint64_t start, const char *arg_name, unsigned long arg);
+
+inline void trace_end(const char *name, uint64_t start, const char *arg_name = nullptr, unsigned long arg = 0) {
+    if (tracing)
+        trace_record(name, start, arg_name, arg);
+}
+
+#endif
@@ -21,16 +21,29 @@
  */
 
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
@@ -38,98 +51,428 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
-
-enum Window_Opaqueness {
-    SOLID = 0,
-    TRANSPARENT = 1,
-    ARGB = 2,
-};
-
-class Client {
-public:
-    Window window;
-    Pixmap pixmap;
-    XWindowAttributes attr;
-    Window_Opaqueness opaqueness;
-    int damaged;
-    Damage damage;
-    Picture picture;
-    Picture alpha_pict;
-    XserverRegion border_size;
-    XserverRegion extents;
-    bool shaped;
-    XRectangle shape_bounds;
-
-    XserverRegion border_clip;
-};
-
-std::vector<Client *> clients;
-
-Display *display;
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xpresent.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/shape.h>
+
+#include "client.h"
+#include "client_pool.h"
+#include "client_stack.h"
+#include "cpu_backend.h"
+#include "event_record.h"
+#include "paint_list.h"
+#include "region.h"
+#include "stats_shm.h"
+#include "thumbnail.h"
+#include "trace.h"
+
+Client_Stack clients;
+Client_Pool client_pool; // where every Client comes from and goes back to
+Paint_List paint_list; // clients, as paint_all looks at them (see current_paint_list)
+
+// With -p the painting happens on a thread of its own with its own connection to the server (see paint_thread_main).
+// The globals that both threads use, each for itself, are thread_local,
+// so the code that paints talks to the paint connection and counts into the paint thread's statistics
+// without having to know which thread it's on.
+//
+thread_local Display *display;
 int default_screen;
 Window root_window;
-int root_height, root_width;
+thread_local int root_height, root_width;
 
 // When we go to paint (composite the screen)
 // we draw everything we need to the root_buffer
 // then once we have finished that, we transfer it over to the root_picture in one go.
 // Why _exactly_ it was chosen to be done this way, I'm not sure. But it's fine.
 Picture root_picture; // the actual reference to the root picture
-Picture root_buffer; // the temporary buffer
+Picture root_buffer; // the temporary buffer, this is the back buffer we're drawing into this frame
 Picture root_tile; // holds the desktop wallpaper image
 
-XserverRegion all_damage; // when this is not zero, it means the screen was damaged and we need to redraw
-bool clip_changed; // Seems to be set to true when the bounds of a window has changed
+// Back buffers (-b)
+// With one back buffer, every frame only has to repaint what got damaged since the buffer still holds the last frame.
+// With more, we take turns drawing into them, so a buffer has missed the damage of every frame since it was last
+// drawn into (its age) and has to repaint that as well.
+// Either way only the damage of the current frame is copied to the screen.
+// More than one is only worth it when presenting a buffer keeps it busy for a while.
+//
+struct Back_Buffer {
+    Picture picture;
+    Pixmap pixmap; // only kept with -P, it's what gets presented
+    int age; // how many frames ago this buffer was painted, 0 when it doesn't hold anything yet
+    bool busy; // presented, and the server hasn't told us it's done reading it (see handle_present_event)
+};
+const int max_back_buffers = 4;
+Back_Buffer back_buffers[max_back_buffers];
+int back_buffer_count = 1;
+int current_back_buffer = 0;
+std::deque<Banded_Region> damage_history; // the damage of the most recent frames, newest first
+
+// Presenting through the Present extension (-P)
+// Instead of copying the back buffer into the root window through a picture that draws over every window
+// (IncludeInferiors), we hand the back buffer's pixmap to the server with PresentPixmap, to show in
+// the Composite overlay window, a window above all the others that only we draw into.
+// The server can then flip to the pixmap instead of copying it, and it tells us when the frame
+// is on the screen (PresentCompleteNotify), which is what paces the frames instead of the -r timer.
+// A presented pixmap may be on the screen until the server lets it go (PresentIdleNotify),
+// so we don't draw into it before then.
+// Without the extension, or with the CPU backend, frames are copied into the root window like before.
+//
+// All of it belongs to the thread that paints, the events go to the connection that selected them.
+//
+bool present_requested = false; // -P
+bool present_enabled = false;
+int present_opcode;
+Window overlay_window;
+uint32_t present_serial; // of the last frame we presented
+bool present_in_flight = false; // the last frame isn't on the screen yet
+uint64_t present_sent_us;
+const uint64_t present_timeout_us = 100000; // how long we wait for the server before we stop waiting
+
+// Rendering backends (-B)
+// XRender has the server do all the compositing. The CPU backend (see cpu_backend.h) does it on our side,
+// which is faster when the server's Render is slow or unaccelerated, like on Xvfb.
+//
+enum Backend {
+    XRENDER_BACKEND,
+    CPU_BACKEND,
+};
+Backend backend = XRENDER_BACKEND;
+
+Shm_Image framebuffer; // the CPU backend's back buffer, in the root's visual
+Shm_Image window_images[2]; // where window contents get copied to, for depth 24 and depth 32 windows
+GC framebuffer_gc;
+bool framebuffer_busy = false; // the server may still be reading the framebuffer for the last XShmPutImage
+Blend_Over_Function blend_over;
+std::vector<uint32_t> wallpaper; // the root tile's pixels for the CPU backend, empty until it's fetched
+int wallpaper_width, wallpaper_height;
+
+// Threaded painting (-p), see publish_snapshot and paint_thread_main
+bool paint_thread_enabled = false;
+bool background_changed = false; // the wallpaper changed since the last snapshot
+
+// Monitors (RandR CRTCs)
+// The root window is the bounding box of all the monitors. When they have different sizes or don't line up,
+// parts of the root aren't shown on any of them. Damage there gets thrown away before we paint,
+// so windows that only cover that dead space are never drawn, and only monitors with damage get presented.
+// Without RandR the whole root is one monitor.
+//
+thread_local std::vector<Region_Box> monitors;
+Banded_Region monitor_area; // all the monitors together
+bool monitors_changed = true; // look the monitors up again before the next frame
+bool has_randr = false;
+
+// Unredirection of fullscreen windows (see update_unredirection)
+bool unredirect_enabled = true; // -U turns it off
+const uint64_t unredirect_delay_us = 500000; // how long a window has to stay fullscreen before we unredirect it
+Window unredirected_window = 0; // the window that's drawing straight to the screen, 0 while we composite
+Window fullscreen_window = 0; // the window that's been fullscreen on top since fullscreen_since_us
+uint64_t fullscreen_since_us;
+
+// Windows that reported damage since the last frame (see damage_client)
+std::vector<Client *> dirty_clients;
+const int max_pending_damage_boxes = 32; // more rectangles than this and we damage the whole window
+
+// Damage throttling (see acknowledge_damage)
+std::vector<Client *> held_back_clients; // dirty windows whose damage has to wait for a later frame
+unsigned int default_max_damage_hz = 0; // -D, 0 means only windows that set _XCOMPMGR_DAMAGE_HZ are held back
+Window active_window = 0; // the top level window _NET_ACTIVE_WINDOW is in, it's never held back
+uint64_t next_deferred_damage_us = 0; // when the earliest held back damage is due, 0 if none is held back
+
+// With -p the damage acknowledged for a frame has to be subtracted on the paint thread's connection (see publish_snapshot)
+struct Damage_Subtract {
+    Window window;
+    Damage damage;
+};
+std::vector<Damage_Subtract> damage_subtracts;
+Client_Damage_Stats worst_offenders[stats_top_clients]; // the windows that damaged the most in the last second
+int worst_offender_count;
+
+Banded_Region all_damage; // when this is not empty, it means the screen was damaged and we need to redraw
+
+// Every rectangle of all_damage is a clip rectangle for every composite of the frame,
+// so damage scattered in hundreds of little pieces gets covered with a few bigger boxes instead (see simplify_damage).
+// How much one rectangle costs compared to a pixel depends on the server, bench-damage-crossover measures it.
+//
+int max_damage_boxes = 16; // -m, more rectangles than this and the damage gets grouped, 0 never simplifies
+long damage_box_cost = 2000; // -c, what one more rectangle costs, in pixels painted
 
 int xfixes_event, xfixes_error;
 int damage_event, damage_error;
 int composite_event, composite_error;
 int render_event, render_error;
 int xshape_event, xshape_error;
+int randr_event, randr_error;
 int composite_opcode;
 
+// Every atom we use, interned in one go at startup (see intern_atoms)
 Atom opacity_atom;
+Atom active_window_atom; // _NET_ACTIVE_WINDOW on the root
+Atom damage_hz_atom; // _XCOMPMGR_DAMAGE_HZ, how often a window wants its damage painted at most
+Atom net_wm_name_atom;
+Atom net_wm_cm_atom; // _NET_WM_CM_S<screen>, owning this selection is how we tell everyone we're the compositor
+
+// Counters describing how much work we make the X server do, printed once a second when started with -s
+//
+struct Statistics {
+    unsigned long frames;
+    unsigned long events;
+    unsigned long damage_events;
+    unsigned long damage_subtracts;
+    unsigned long damage_collapses; // times a window's damage was replaced by its extents (see damage_client)
+    unsigned long damage_deferrals; // times a window's damage was held back for a later frame (see acknowledge_damage)
+    unsigned long damage_simplifications; // times all_damage was covered with fewer, bigger boxes (see simplify_damage)
+    unsigned long simplified_boxes; // rectangles that saved
+    unsigned long regions_computed; // Banded_Regions our region math built (see stats_shm.h)
+    unsigned long server_regions_created; // XFixes regions we had the server make, only with -P
+    unsigned long composites; // XRenderComposite requests
+    unsigned long composited_pixels; // how many pixels those composites were allowed to touch
+    unsigned long requests; // every request we sent to the server
+    unsigned long round_trips; // requests where we had to sit and wait for the server to answer
+    unsigned long errors;
+    unsigned long skipped_frames; // frames put off because we were behind on events
+    unsigned long candidate_windows; // windows near enough to the damage for the occlusion pass to look at them
+    unsigned long culled_windows; // damaged windows we didn't composite because windows above hide them
+    unsigned long culled_pixels; // how much of the damage those windows didn't have to draw
+    unsigned long root_tiles_skipped; // frames where windows hid all of the wallpaper
+    unsigned long repainted_pixels; // pixels drawn into the back buffers
+    unsigned long presented_pixels; // pixels copied from the back buffers to the screen
+    unsigned long monitors_presented; // monitors we copied something to
+    unsigned long dead_space_pixels; // damage thrown away because no monitor shows it
+    unsigned long unredirections; // times a fullscreen window was handed straight to the screen
+    unsigned long presents; // PresentPixmap requests (-P)
+    unsigned long present_flips; // presents the server did by flipping instead of copying
+    unsigned long present_wait_us; // from PresentPixmap until the frame was on the screen, all of them together
+    unsigned long present_timeouts; // times we stopped waiting for a PresentCompleteNotify or PresentIdleNotify
+    unsigned long thumbnail_requests; // from other programs, over the -L socket
+    unsigned long thumbnails_drawn; // the ones of those we had to draw the thumbnail again for
+    timeval last_print;
+};
+thread_local Statistics stats;
+
+bool print_stats = false;
+Statistics previous_frame_stats; // stats right after the previous frame was published
+
+// Pixmaps and pictures we own right now, to spot leaks (see create_picture).
+// With -p both threads make them, the paint thread to paint and the event thread for thumbnails.
+std::atomic<long> live_pixmaps(0);
+std::atomic<long> live_pictures(0);
+
+// Where every frame gets published for xcompmgr-simple-stats to read, nullptr when started with -N
+Stats_Shm *stats_shm = nullptr;
+bool synchronous = false; // -S, every request waits for the server, which makes errors show up where they happen
+
+// Frame pacing (see run_event_loop)
+long frame_interval_us = 1000000 / 60; // -r, the least amount of time between two frames
+bool immediate_mode = false; // -i, paint as soon as we run out of events, for the lowest possible latency
+const int backlog_limit = 256; // this many events since the last frame means we're falling behind
+const int max_skipped_frames = 2; // how many frames in a row we may put off to catch up on events
+thread_local unsigned long frame_first_request; // sequence number of the first request sent in the current frame
+uint64_t startup_grab_us; // how long add_existing_clients held the server grab
+
+const int default_trace_spans = 1 << 20; // -T, about 40MB of spans
+
+// Requests are sent to the server in batches (see the bottom of main) so when one fails,
+// the error arrives long after the function that sent it returned.
+// Requests about a client's window can fail at any moment because the window can be destroyed behind our back,
+// so for those we remember the sequence number X assigned them, and which window they were about.
+// When the error shows up, the error_handler uses the sequence number to find out which window it was for.
+//
+struct Window_Request {
+    unsigned long sequence;
+    Window window;
+};
+thread_local std::deque<Window_Request> window_requests;
+thread_local std::vector<Window> failed_windows; // windows which had a request fail since the last frame
+
+// Call this right before sending a request about the window
+void track_window_request(Window window) {
+    Window_Request request;
+    request.sequence = NextRequest(display);
+    request.window = window;
+    window_requests.push_back(request);
+}
+
+// Forgets about requests the server has already gotten through,
+// since an error for them would have arrived before anything after them did
+void prune_window_requests() {
+    unsigned long processed = LastKnownRequestProcessed(display);
+    while (!window_requests.empty() && window_requests.front().sequence <= processed)
+        window_requests.pop_front();
+}
 
-const char *backgroundProps[] = {
+const int background_prop_count = 2;
+const char *backgroundProps[background_prop_count] = {
         "_XROOTPMAP_ID",
         "_XSETROOT_ID",
-        nullptr,
 };
+Atom background_atoms[background_prop_count];
 
-// This takes the desktop wallpaper (if one is set) and turns it into a picture
-// so that we can draw it when it's time to composite the screen
+uint64_t monotonic_us() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Event recording (-E file, see event_record.h), only the event thread writes records
+FILE *event_record_file = nullptr;
+uint64_t event_record_start_us;
+
+void event_record_open(const char *path) {
+    event_record_file = fopen(path, "wb");
+    if (!event_record_file) {
+        perror(path);
+        exit(1);
+    }
+    // Records are small and come in bursts, so they get written out a megabyte at a time
+    setvbuf(event_record_file, nullptr, _IOFBF, 1 << 20);
+    event_record_write_header(event_record_file, root_window, root_width, root_height);
+    event_record_start_us = monotonic_us();
+}
+
+void event_record_close() {
+    if (!event_record_file)
+        return;
+    if (fclose(event_record_file) != 0)
+        perror("event record");
+    event_record_file = nullptr;
+}
+
+void write_record(Event_Record &record) {
+    record.time_us = monotonic_us() - event_record_start_us;
+    fwrite(&record, sizeof(record), 1, event_record_file);
+}
+
+void record_shape(Window window, int shaped, int x, int y, int width, int height) {
+    Event_Record record = {};
+    record.type = RECORD_SHAPE;
+    record.window = window;
+    record.flags = shaped ? RECORD_SHAPED : 0;
+    record.x = x;
+    record.y = y;
+    record.width = width;
+    record.height = height;
+    write_record(record);
+}
+
+void record_window(const Client *client, int opacity_level) {
+    const XWindowAttributes &attr = client->attr;
+    Event_Record record = {};
+    record.type = RECORD_WINDOW;
+    record.window = client->window;
+    record.x = attr.x;
+    record.y = attr.y;
+    record.width = attr.width;
+    record.height = attr.height;
+    record.border_width = attr.border_width;
+    record.value = opacity_level;
+    record.flags = (attr.override_redirect ? RECORD_OVERRIDE_REDIRECT : 0) |
+                   (attr.map_state == IsViewable ? RECORD_VIEWABLE : 0) |
+                   (attr.depth == 32 ? RECORD_ARGB : 0) |
+                   (client->shaped ? RECORD_SHAPED : 0) |
+                   (attr.c_class == InputOnly ? RECORD_INPUT_ONLY : 0);
+    write_record(record);
+    if (client->shaped)
+        record_shape(client->window, true, client->shape_bounds.x - attr.x, client->shape_bounds.y - attr.y,
+                     client->shape_bounds.width, client->shape_bounds.height);
+}
+
+void record_opacity(Window window, int opacity_level) {
+    Event_Record record = {};
+    record.type = RECORD_OPACITY;
+    record.window = window;
+    record.value = opacity_level;
+    write_record(record);
+}
+
+// XRenderFindVisualFormat searches the list of every format the server has, every time.
+// There are only a handful of visuals, so we remember the answer for each.
 //
-Picture create_root_tile() {
+XRenderPictFormat *find_visual_format(Visual *visual) {
+    static thread_local std::unordered_map<VisualID, XRenderPictFormat *> formats;
+    if (!visual)
+        return nullptr;
+    auto found = formats.find(visual->visualid);
+    if (found != formats.end())
+        return found->second;
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, visual);
+    formats[visual->visualid] = format;
+    return format;
+}
+
+// Every pixmap and picture we make goes through these, so that the statistics know how many are alive
+//
+Picture create_picture(Drawable drawable, const XRenderPictFormat *format, unsigned long mask,
+                       const XRenderPictureAttributes *attributes) {
+    live_pictures++;
+    return XRenderCreatePicture(display, drawable, format, mask, attributes);
+}
+
+void free_picture(Picture &picture) {
+    if (!picture)
+        return;
+    XRenderFreePicture(display, picture);
+    picture = 0;
+    live_pictures--;
+}
+
+Pixmap create_pixmap(unsigned int width, unsigned int height, unsigned int depth) {
+    live_pixmaps++;
+    return XCreatePixmap(display, root_window, width, height, depth);
+}
+
+void free_pixmap(Pixmap &pixmap) {
+    if (!pixmap)
+        return;
+    XFreePixmap(display, pixmap);
+    pixmap = 0;
+    live_pixmaps--;
+}
+
+// The pixmap holding the desktop wallpaper, 0 if none is set
+Pixmap find_background_pixmap() {
     Pixmap pixmap = 0;
     int actual_format;
     unsigned long items_count;
     unsigned long bytes_after;
     unsigned char *prop;
-    bool fill = false;
 
     Atom actual_type;
-    for (int p = 0; backgroundProps[p]; p++) {
-        if (XGetWindowProperty(display, root_window, XInternAtom(display, backgroundProps[p], false),
+    for (int p = 0; p < background_prop_count; p++) {
+        stats.round_trips++;
+        if (XGetWindowProperty(display, root_window, background_atoms[p],
                                0, 4, false, AnyPropertyType,
                                &actual_type, &actual_format, &items_count, &bytes_after, &prop) == Success &&
-            actual_type == XInternAtom(display, "PIXMAP", false) && actual_format == 32 && items_count == 1) {
+            actual_type == XA_PIXMAP && actual_format == 32 && items_count == 1) {
             memcpy(&pixmap, prop, 4);
             XFree(prop);
-            fill = false;
             break;
         }
     }
+    return pixmap;
+}
+
+// This takes the desktop wallpaper (if one is set) and turns it into a picture
+// so that we can draw it when it's time to composite the screen
+//
+Picture create_root_tile() {
+    Pixmap pixmap = find_background_pixmap();
+    bool fill = false;
     if (!pixmap) {
-        pixmap = XCreatePixmap(display, root_window, 1, 1, XDefaultDepth(display, default_screen));
+        pixmap = create_pixmap(1, 1, XDefaultDepth(display, default_screen));
         fill = true;
     }
 
     XRenderPictureAttributes pa;
     pa.repeat = true;
-    Picture picture = XRenderCreatePicture(display, pixmap,
-                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
-                                           CPRepeat, &pa);
+    Picture picture = create_picture(pixmap,
+                                     find_visual_format(XDefaultVisual(display, default_screen)),
+                                     CPRepeat, &pa);
     if (fill) { // If no background is set, then will just fill the background with the color 0x8080
+        // The picture keeps the pixmap alive for as long as it needs it
+        free_pixmap(pixmap);
         XRenderColor c;
         c.red = c.green = c.blue = 0x8080;
         c.alpha = 0xffff;
@@ -145,521 +488,2580 @@ void paint_root() {
     if (!root_tile)
         root_tile = create_root_tile();
 
+    stats.composites++;
     XRenderComposite(display, PictOpSrc,
                      root_tile, 0, root_buffer,
                      0, 0, 0, 0, 0, 0, root_width, root_height);
 }
 
-XserverRegion client_extents(Client *client) {
-    XRectangle r;
-    r.x = client->attr.x;
-    r.y = client->attr.y;
-    r.width = client->attr.width + client->attr.border_width * 2;
-    r.height = client->attr.height + client->attr.border_width * 2;
-    return XFixesCreateRegion(display, &r, 1);
-}
-
-XserverRegion get_border_size(Client *client) {
-    XserverRegion border;
-    /*
-     * if window doesn't exist anymore,  this will generate an error_handler
-     * as well as not generate a region.  Perhaps a better XFixes
-     * architecture would be to have a request that copies instead
-     * of creates, that way you'd just end up with an empty region
-     * instead of an invalid XID.
-     */
-    border = XFixesCreateRegionFromWindow(display, client->window, WindowRegionBounding);
-    /* translate this */
-    XFixesTranslateRegion(display, border,
-                          client->attr.x + client->attr.border_width,
-                          client->attr.y + client->attr.border_width);
+// Every window pixmap ever named gets its own generation, so that the paint thread (-p),
+// which keeps its own pixmaps, can tell when it has to name a window's pixmap again
+unsigned int pixmap_generations;
+
+// Called when the window's pixmap stops showing what's in the window, after it was resized, unmapped, or redirected
+void release_client_pixmap(Client *client) {
+    free_picture(client->picture);
+    free_pixmap(client->pixmap);
+    client->pixmap_generation = ++pixmap_generations;
+}
+
+Banded_Region client_extents(Client *client) {
+    return Banded_Region(client->attr.x, client->attr.y,
+                         client->attr.width + client->attr.border_width * 2,
+                         client->attr.height + client->attr.border_width * 2);
+}
+
+Banded_Region get_border_size(Client *client) {
+    // A window that isn't shaped covers its whole rectangle, so there's no need to ask the server
+    if (!client->shaped)
+        return client_extents(client);
+
+    // The shape only changes with a ShapeNotify, moving or resizing the window doesn't touch it
+    if (!client->shape_valid) {
+        /*
+         * if window doesn't exist anymore,  this will generate an error_handler
+         * and give us no rectangles, so we just end up with an empty region.
+         */
+        int count = 0;
+        int ordering;
+        track_window_request(client->window);
+        stats.round_trips++;
+        XRectangle *rectangles = XShapeGetRectangles(display, client->window, ShapeBounding, &count, &ordering);
+        client->shape = Banded_Region::from_rectangles(rectangles, count);
+        if (rectangles)
+            XFree(rectangles);
+        /* translate this */
+        client->shape.translate(client->attr.x + client->attr.border_width,
+                                client->attr.y + client->attr.border_width);
+        client->shape_valid = true;
+    }
+    // The shape can reach past the window, but nothing outside the window is shown
+    Banded_Region border = client->shape;
+    border.intersect(client_extents(client));
     return border;
 }
 
-void paint_all(XserverRegion region) {
-    if (!region) {
-        XRectangle r;
-        r.x = 0;
-        r.y = 0;
-        r.width = root_width;
-        r.height = root_height;
-        region = XFixesCreateRegion(display, &r, 1);
-    }
-    if (!root_buffer) {
-        Pixmap rootPixmap = XCreatePixmap(display, root_window, root_width, root_height,
-                                          XDefaultDepth(display, default_screen));
-        root_buffer = XRenderCreatePicture(display, rootPixmap,
-                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
-                                           0, nullptr);
-        XFreePixmap(display, rootPixmap);
-    }
-    XFixesSetPictureClipRegion(display, root_picture, 0, 0, region);
-
-    for (Client *w : clients) {
-        /* never painted, ignore it */
-        if (!w->damaged) {
-            continue;
+// Limits drawing into the picture to the region. An empty region means nothing gets drawn at all.
+void set_picture_clip(Picture picture, const Banded_Region &region) {
+    static std::vector<XRectangle> rectangles;
+    region.to_rectangles(rectangles);
+    XRenderSetPictureClipRectangles(display, picture, 0, 0, rectangles.data(), rectangles.size());
+}
+
+// The pixmap the server keeps the window's contents in, for as long as it doesn't change size
+void name_client_pixmap(Client *w) {
+    if (w->pixmap)
+        return;
+    track_window_request(w->window);
+    w->pixmap = XCompositeNameWindowPixmap(display, w->window);
+    live_pixmaps++;
+}
+
+void create_client_picture(Client *w) {
+    XRenderPictureAttributes pa;
+    XRenderPictFormat *format;
+    Drawable draw = w->window;
+
+    name_client_pixmap(w);
+    if (w->pixmap)
+        draw = w->pixmap;
+
+    format = find_visual_format(w->attr.visual);
+    pa.subwindow_mode = IncludeInferiors;
+    track_window_request(w->window);
+    w->picture = create_picture(draw, format, CPSubwindowMode, &pa);
+}
+
+// _NET_WM_WINDOW_OPACITY goes from 0 (invisible) to 0xffffffff (opaque).
+// We only keep 256 different levels of it so that all the windows at the same level can share one alpha picture
+// (a 1x1 repeating picture filled with that alpha) which is used as the mask when we composite them.
+// The pictures are made the first time a level is needed and are kept around until we exit.
+//
+const int opacity_levels = 256;
+const int opaque_level = opacity_levels - 1;
+Picture alpha_pictures[opacity_levels];
+
+Picture get_alpha_picture(int level) {
+    if (!alpha_pictures[level]) {
+        Pixmap pixmap = create_pixmap(1, 1, 8);
+        XRenderPictureAttributes pa;
+        pa.repeat = true;
+        alpha_pictures[level] = create_picture(pixmap, XRenderFindStandardFormat(display, PictStandardA8),
+                                               CPRepeat, &pa);
+        free_pixmap(pixmap);
+
+        XRenderColor c;
+        c.red = c.green = c.blue = 0;
+        c.alpha = level * 0xffff / opaque_level;
+        XRenderFillRectangle(display, PictOpSrc, alpha_pictures[level], &c, 0, 0, 1, 1);
+    }
+    return alpha_pictures[level];
+}
+
+// CPU backend (-B cpu), these do what paint_client, paint_root, and the present in paint_all do with XRender
+//
+
+// The server copies out of the framebuffer when it gets to our XShmPutImage, not when we send it,
+// so before drawing into it again we have to be sure it's done. Any round trip after the put will do.
+void cpu_wait_for_framebuffer() {
+    if (framebuffer_busy) {
+        stats.round_trips++;
+        XSync(display, false);
+        framebuffer_busy = false;
+    }
+}
+
+void cpu_create_framebuffer() {
+    if (!create_shm_image(display, XDefaultVisual(display, default_screen), XDefaultDepth(display, default_screen),
+                          root_width, root_height, framebuffer)) {
+        fprintf(stderr, "Can't create a shared memory framebuffer for the CPU backend\n");
+        exit(1);
+    }
+}
+
+void cpu_free_buffers() {
+    destroy_shm_image(display, framebuffer);
+    for (Shm_Image &image : window_images)
+        destroy_shm_image(display, image);
+    framebuffer_busy = false;
+}
+
+// Copies the wallpaper out of the server, only when it changes
+void cpu_load_wallpaper() {
+    Pixmap pixmap = find_background_pixmap();
+    Window root;
+    int x, y;
+    unsigned int width, height, border_width, depth;
+    stats.round_trips++;
+    if (pixmap && XGetGeometry(display, pixmap, &root, &x, &y, &width, &height, &border_width, &depth) &&
+        (depth == 24 || depth == 32)) {
+        stats.round_trips++;
+        XImage *image = XGetImage(display, pixmap, 0, 0, width, height, AllPlanes, ZPixmap);
+        if (image && image->bits_per_pixel == 32) {
+            wallpaper_width = width;
+            wallpaper_height = height;
+            wallpaper.resize((size_t) width * height);
+            for (unsigned int row = 0; row < height; row++)
+                memcpy(&wallpaper[(size_t) row * width], image->data + (long) row * image->bytes_per_line, width * 4);
         }
-        /* if invisible, ignore it */
-        if (w->attr.x + w->attr.width < 1 || w->attr.y + w->attr.height < 1
-            || w->attr.x >= root_width || w->attr.y >= root_height)
+        if (image)
+            XDestroyImage(image);
+    }
+    // If no background is set, then will just fill the background with the color 0x8080
+    if (wallpaper.empty()) {
+        wallpaper_width = wallpaper_height = 1;
+        wallpaper.assign(1, 0xff808080);
+    }
+}
+
+void cpu_paint_root(const Banded_Region &region) {
+    if (wallpaper.empty())
+        cpu_load_wallpaper();
+    cpu_wait_for_framebuffer();
+    for (const Region_Box &box : region.box_list())
+        fill_tiled(framebuffer, box, wallpaper.data(), wallpaper_width, wallpaper_height);
+    stats.composites++;
+}
+
+// Copies the part of the window in its border_clip out of the server and blends it into the framebuffer
+void cpu_paint_client(Client *w) {
+    // We only handle the 32 bits per pixel depths, which is nearly every window there is
+    int depth = w->attr.depth;
+    if (depth != 24 && depth != 32)
+        return;
+    Shm_Image &scratch = window_images[depth == 32 ? 1 : 0];
+    if (!scratch.image && !create_shm_image(display, w->attr.visual, depth, root_width, root_height, scratch))
+        return;
+
+    if (!w->pixmap) {
+        track_window_request(w->window);
+        w->pixmap = XCompositeNameWindowPixmap(display, w->window);
+        live_pixmaps++;
+    }
+
+    // The scratch image is as big as the root, we only fetch the box around what's visible.
+    // XShmGetImage takes the size from the image, so we shrink it to the box.
+    const Region_Box &box = w->border_clip.extents();
+    int width = box.x2 - box.x1;
+    scratch.image->width = width;
+    scratch.image->height = box.y2 - box.y1;
+    scratch.image->bytes_per_line = width * 4;
+    track_window_request(w->window);
+    stats.round_trips++;
+    // (the window pixmap starts at the outside corner of the border, just like attr.x and attr.y)
+    bool fetched = XShmGetImage(display, w->pixmap, scratch.image, box.x1 - w->attr.x, box.y1 - w->attr.y, AllPlanes);
+    framebuffer_busy = false; // that was a round trip
+    if (!fetched)
+        return;
+
+    // Depth 24 windows don't have an alpha channel, their top byte is garbage
+    bool opaque_source = depth != 32;
+    const uint32_t *pixels = (const uint32_t *) scratch.image->data;
+    for (const Region_Box &part : w->border_clip.box_list())
+        blend_box(framebuffer, part, pixels, box.x1, box.y1, width, blend_over, w->opacity_level, opaque_source);
+}
+
+void cpu_present(const Banded_Region &damage) {
+    for (const Region_Box &monitor : monitors) {
+        Banded_Region part = damage;
+        part.intersect(Banded_Region(monitor));
+        if (part.empty())
             continue;
-        if (!w->picture) {
-            XRenderPictureAttributes pa;
-            XRenderPictFormat *format;
-            Drawable draw = w->window;
-
-            if (!w->pixmap)
-                w->pixmap = XCompositeNameWindowPixmap(display, w->window);
-            if (w->pixmap)
-                draw = w->pixmap;
-
-            format = XRenderFindVisualFormat(display, w->attr.visual);
-            pa.subwindow_mode = IncludeInferiors;
-            w->picture = XRenderCreatePicture(display, draw,
-                                              format,
-                                              CPSubwindowMode,
-                                              &pa);
-        }
-        if (clip_changed) {
-            if (w->border_size) {
-                XFixesDestroyRegion(display, w->border_size);
-                w->border_size = 0;
+        for (const Region_Box &box : part.box_list())
+            XShmPutImage(display, root_window, framebuffer_gc, framebuffer.image, box.x1, box.y1, box.x1, box.y1,
+                         box.x2 - box.x1, box.y2 - box.y1, false);
+        stats.monitors_presented++;
+        stats.composites++;
+        stats.composited_pixels += part.area();
+    }
+    stats.presented_pixels += damage.area();
+    framebuffer_busy = true;
+}
+
+// Composites the part of the window that is in its border_clip into the root_buffer
+void paint_client(Client *w, int op) {
+    int x, y, wid, hei;
+
+    if (backend == CPU_BACKEND) {
+        uint64_t trace = trace_start();
+        cpu_paint_client(w);
+        trace_end("composite", trace, "window", w->window);
+        stats.composites++;
+        stats.composited_pixels += w->border_clip.area();
+        w->border_clip.clear();
+        return;
+    }
+
+    if (!w->picture)
+        create_client_picture(w);
+    set_picture_clip(root_buffer, w->border_clip);
+
+    x = w->attr.x;
+    y = w->attr.y;
+    wid = w->attr.width + w->attr.border_width * 2;
+    hei = w->attr.height + w->attr.border_width * 2;
+
+    Picture alpha = w->opacity_level == opaque_level ? 0 : get_alpha_picture(w->opacity_level);
+    uint64_t trace = trace_start();
+    XRenderComposite(display, op, w->picture, alpha, root_buffer,
+                     0, 0, 0, 0,
+                     x, y, wid, hei);
+    trace_end("composite", trace, "window", w->window);
+    stats.composites++;
+    stats.composited_pixels += w->border_clip.area();
+    w->border_clip.clear();
+}
+
+void free_back_buffers() {
+    if (backend == CPU_BACKEND)
+        cpu_free_buffers();
+    for (Back_Buffer &buffer : back_buffers) {
+        free_picture(buffer.picture);
+        free_pixmap(buffer.pixmap);
+        buffer.age = 0;
+        buffer.busy = false;
+    }
+    damage_history.clear();
+    root_buffer = 0;
+}
+
+// Picks the next back buffer and makes it the root_buffer.
+// Returns the region of the buffer that has to be painted for it to show the current frame.
+//
+Banded_Region start_back_buffer(const Banded_Region &damage) {
+    damage_history.push_front(damage);
+    if ((int) damage_history.size() > back_buffer_count)
+        damage_history.pop_back();
+
+    // Taking turns, except for the ones the server is still reading (-P, see present_ready)
+    int next = (current_back_buffer + 1) % back_buffer_count;
+    for (int i = 0; i < back_buffer_count && back_buffers[next].busy; i++)
+        next = (next + 1) % back_buffer_count;
+    current_back_buffer = next;
+    Back_Buffer &buffer = back_buffers[current_back_buffer];
+    if (!buffer.picture) {
+        Pixmap rootPixmap = create_pixmap(root_width, root_height, XDefaultDepth(display, default_screen));
+        buffer.picture = create_picture(rootPixmap,
+                                        find_visual_format(XDefaultVisual(display, default_screen)),
+                                        0, nullptr);
+        if (present_enabled)
+            buffer.pixmap = rootPixmap;
+        else
+            free_pixmap(rootPixmap);
+        buffer.age = 0;
+    }
+    root_buffer = buffer.picture;
+
+    if (buffer.age == 0 || buffer.age > (int) damage_history.size())
+        return Banded_Region(0, 0, root_width, root_height);
+    Banded_Region region = damage;
+    for (int i = 1; i < buffer.age; i++)
+        region.unite(damage_history[i]);
+    return region;
+}
+
+void finish_back_buffer() {
+    for (int i = 0; i < back_buffer_count; i++) {
+        if (back_buffers[i].age)
+            back_buffers[i].age++;
+    }
+    back_buffers[current_back_buffer].age = 1;
+}
+
+// Shows the back buffer in the overlay window, the server only copies the damage unless it can flip
+void present_back_buffer(const Banded_Region &damage) {
+    static std::vector<XRectangle> rectangles;
+    damage.to_rectangles(rectangles);
+    XserverRegion update = XFixesCreateRegion(display, rectangles.data(), rectangles.size());
+    stats.server_regions_created++;
+    Back_Buffer &buffer = back_buffers[current_back_buffer];
+    XPresentPixmap(display, overlay_window, buffer.pixmap, ++present_serial, None, update, 0, 0, None, None, None,
+                   PresentOptionNone, 0, 0, 0, nullptr, 0);
+    XFixesDestroyRegion(display, update);
+    buffer.busy = true;
+    present_in_flight = true;
+    present_sent_us = monotonic_us();
+    stats.presents++;
+    stats.presented_pixels += damage.area();
+}
+
+// Whether the next frame can be painted: the last one is on the screen and there's a back buffer
+// the server isn't reading. If the server goes quiet for too long we stop waiting,
+// so a lost event can't stop the painting for good.
+//
+bool present_ready(uint64_t now) {
+    if (present_in_flight && now - present_sent_us >= present_timeout_us) {
+        present_in_flight = false;
+        for (Back_Buffer &buffer : back_buffers)
+            buffer.busy = false;
+        stats.present_timeouts++;
+    }
+    if (present_in_flight)
+        return false;
+    for (int i = 0; i < back_buffer_count; i++) {
+        if (!back_buffers[i].busy)
+            return true;
+    }
+    if (now - present_sent_us >= present_timeout_us) {
+        for (Back_Buffer &buffer : back_buffers)
+            buffer.busy = false;
+        stats.present_timeouts++;
+        return true;
+    }
+    return false;
+}
+
+// When present_ready gives up waiting
+uint64_t present_deadline() {
+    return present_sent_us + present_timeout_us;
+}
+
+// Returns false for anything that isn't a Present event
+bool handle_present_event(XEvent *ev) {
+    XGenericEventCookie *cookie = &ev->xcookie;
+    if (ev->type != GenericEvent || cookie->extension != present_opcode || !XGetEventData(display, cookie))
+        return false;
+    if (cookie->evtype == PresentCompleteNotify) {
+        XPresentCompleteNotifyEvent *complete = (XPresentCompleteNotifyEvent *) cookie->data;
+        if (present_in_flight && complete->serial_number == present_serial) {
+            present_in_flight = false;
+            stats.present_wait_us += monotonic_us() - present_sent_us;
+            if (complete->mode == PresentCompleteModeFlip)
+                stats.present_flips++;
+        }
+    } else if (cookie->evtype == PresentIdleNotify) {
+        XPresentIdleNotifyEvent *idle = (XPresentIdleNotifyEvent *) cookie->data;
+        for (Back_Buffer &buffer : back_buffers) {
+            if (buffer.pixmap && buffer.pixmap == idle->pixmap)
+                buffer.busy = false;
+        }
+    }
+    XFreeEventData(display, cookie);
+    return true;
+}
+
+// Has to be called on the connection that presents
+void present_select_input() {
+    XPresentSelectInput(display, overlay_window, PresentCompleteNotifyMask | PresentIdleNotifyMask);
+}
+
+// Sets up -P on the event thread, returns false when we have to fall back to copying into the root
+bool init_present() {
+    if (backend == CPU_BACKEND) {
+        fprintf(stderr, "Presenting (-P) only works with the xrender backend, copying to the root window instead\n");
+        return false;
+    }
+    int present_event, present_error;
+    if (!XPresentQueryExtension(display, &present_opcode, &present_event, &present_error)) {
+        fprintf(stderr, "No Present extension, copying to the root window instead\n");
+        return false;
+    }
+    overlay_window = XCompositeGetOverlayWindow(display, root_window);
+    if (!overlay_window) {
+        fprintf(stderr, "No composite overlay window, copying to the root window instead\n");
+        return false;
+    }
+    // Clicks have to go through it, to the windows below
+    XserverRegion empty = XFixesCreateRegion(display, nullptr, 0);
+    XFixesSetWindowShapeRegion(display, overlay_window, ShapeInput, 0, 0, empty);
+    XFixesDestroyRegion(display, empty);
+    stats.server_regions_created++;
+    return true;
+}
+
+// The overlay is above every window, so it has to get out of the way of an unredirected one (see update_unredirection)
+void set_overlay_visible(bool visible) {
+    if (visible) {
+        XFixesSetWindowShapeRegion(display, overlay_window, ShapeBounding, 0, 0, None);
+        return;
+    }
+    XserverRegion empty = XFixesCreateRegion(display, nullptr, 0);
+    XFixesSetWindowShapeRegion(display, overlay_window, ShapeBounding, 0, 0, empty);
+    XFixesDestroyRegion(display, empty);
+    stats.server_regions_created++;
+}
+
+// The windows to paint are in list, the clients themselves or the copies of them in a Frame_Snapshot
+void paint_all(const Banded_Region &damage, Paint_List &list) {
+    // The CPU backend has a single framebuffer, which always holds the previous frame
+    Banded_Region region;
+    if (backend == CPU_BACKEND) {
+        if (!framebuffer.image)
+            cpu_create_framebuffer();
+        region = damage;
+    } else {
+        region = start_back_buffer(damage);
+    }
+    stats.repainted_pixels += region.area();
+
+    uint64_t trace = trace_start();
+
+    // Before we draw anything we go through the windows from the top down (occlusion pass)
+    // and work out which part of the damage each window is actually visible in, its border_clip.
+    // Every SOLID window hides whatever is below it, so we take it away from the region as we go.
+    // A window whose border_clip comes out empty is culled: we don't create a picture for it,
+    // we don't set a clip for it, and we don't composite it.
+    // Windows that were never drawn to, or are nowhere near the damage, don't even get that far (see Paint_List).
+    // They're picked out a block at a time, so we stop looking as soon as the damage is all covered,
+    // and every block gets checked against what's left of it.
+    //
+    static std::vector<int> candidates;
+    candidates.clear();
+    for (size_t first = 0; first < list.size(); first += Paint_List::block_size) {
+        // Once the damage is all covered up, everything further down is hidden.
+        // (Their regions don't need looking at, every window keeps its own up to date, see configure_client.)
+        if (region.empty())
+            break;
+        size_t next = candidates.size();
+        list.find_candidates(region.extents(), first, first + Paint_List::block_size, candidates);
+        for (; next < candidates.size(); next++) {
+            if (region.empty()) {
+                candidates.resize(next);
+                break;
             }
-            if (w->extents) {
-                XFixesDestroyRegion(display, w->extents);
-                w->extents = 0;
+
+            Client *w = list.clients[candidates[next]];
+            if (!w->border_size_valid) {
+                w->border_size = get_border_size(w);
+                w->border_size_valid = true;
+                stats.regions_computed++;
+            }
+            if (w->extents.empty()) {
+                w->extents = client_extents(w);
+                stats.regions_computed++;
+            }
+
+            w->border_clip = region;
+            w->border_clip.intersect(w->border_size);
+            stats.regions_computed++;
+            if (w->border_clip.empty()) {
+                // Only count it if it was damaged and we got away with not drawing it
+                Banded_Region hidden = damage;
+                hidden.intersect(w->border_size);
+                stats.regions_computed++;
+                if (!hidden.empty()) {
+                    stats.culled_windows++;
+                    stats.culled_pixels += hidden.area();
+                }
+                continue;
             }
-            if (w->border_clip) {
-                XFixesDestroyRegion(display, w->border_clip);
-                w->border_clip = 0;
+            if (w->opaqueness == Window_Opaqueness::SOLID) {
+                region.subtract(w->border_size);
+                stats.regions_computed++;
             }
         }
-        if (w->border_size == 0)
-            w->border_size = get_border_size(w);
-        if (w->extents == 0)
-            w->extents = client_extents(w);
-        if (w->opaqueness == Window_Opaqueness::SOLID) {
-            int x, y, wid, hei;
+    }
+    stats.candidate_windows += candidates.size();
 
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
+    trace_end("occlusion pass", trace);
+
+    // The SOLID windows don't overlap in what's left of their border_clip, so the order doesn't matter
+    trace = trace_start();
+    for (int i : candidates) {
+        Client *w = list.clients[i];
+        if (!w->border_clip.empty() && w->opaqueness == Window_Opaqueness::SOLID)
+            paint_client(w, PictOpSrc);
+    }
+    trace_end("opaque pass", trace);
+
+    // This is the start of actually compositing the screen
+    // this composites the root_tile which is the background image of your computer to the root_buffer.
+    // If you didn't do this step, you would end up drawing the windows on top of themselves over and over
+    // leading to a trailing effect.
+    // When SOLID windows cover all of the damage there's no wallpaper showing, so we can skip it.
+    //
+    if (!region.empty()) {
+        trace = trace_start();
+        if (backend == CPU_BACKEND) {
+            cpu_paint_root(region);
+        } else {
+            set_picture_clip(root_buffer, region);
+            paint_root();
+        }
+        stats.composited_pixels += region.area();
+        trace_end("paint_root", trace);
+    } else {
+        stats.root_tiles_skipped++;
+    }
+
+    // Here we walk the clients from the bottom of the stack up to the top.
+    // The reason we do this is because the window that is at the top of the window hierarchy
+    // has to be composited last if we want it to be rendered on top of all other windows.
+    //
+    trace = trace_start();
+    for (auto i = candidates.rbegin(); i != candidates.rend(); ++i) {
+        Client *w = list.clients[*i];
+        if (!w->border_clip.empty())
+            paint_client(w, PictOpOver);
+    }
+    trace_end("translucent pass", trace);
+
+    // Present: only what was damaged this frame gets copied to the screen,
+    // everything else on the screen is still correct from earlier frames
+    // (one copy per monitor, so a copy never spans the dead space between two of them)
+    if (backend == CPU_BACKEND) {
+        trace = trace_start();
+        cpu_present(damage);
+        trace_end("present", trace);
+    } else if (present_enabled) {
+        trace = trace_start();
+        present_back_buffer(damage);
+        trace_end("present", trace);
+    } else if (root_buffer != root_picture) {
+        trace = trace_start();
+        XFixesSetPictureClipRegion(display, root_buffer, 0, 0, 0);
+        set_picture_clip(root_picture, damage);
+        for (const Region_Box &monitor : monitors) {
+            Banded_Region part = damage;
+            part.intersect(Banded_Region(monitor));
+            if (part.empty())
+                continue;
+            const Region_Box &box = part.extents();
+            XRenderComposite(display, PictOpSrc, root_buffer, 0, root_picture,
+                             box.x1, box.y1, 0, 0, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+            stats.monitors_presented++;
+            stats.composites++;
+            stats.composited_pixels += part.area();
+        }
+        stats.presented_pixels += damage.area();
+        trace_end("present", trace);
+    }
+    if (backend != CPU_BACKEND)
+        finish_back_buffer();
+}
+
+void simplify_damage() {
+    if (!max_damage_boxes)
+        return;
+    int boxes = all_damage.box_count();
+    if (all_damage.simplify(max_damage_boxes, damage_box_cost)) {
+        stats.regions_computed++;
+        stats.damage_simplifications++;
+        stats.simplified_boxes += boxes - all_damage.box_count();
+    }
+}
+
+void add_damage(const Banded_Region &damage) {
+    all_damage.unite(damage);
+    stats.regions_computed++;
+    // Every unite walks all the rectangles, so a flood of little ones would make the next one slower and slower
+    if (max_damage_boxes && all_damage.box_count() > 8 * max_damage_boxes)
+        simplify_damage();
+}
+
+// Asks RandR where the monitors are (see monitors)
+void update_monitors() {
+    monitors.clear();
+    std::vector<Region_Box> crtcs; // the ones that are on
+    if (has_randr) {
+        stats.round_trips++;
+        XRRScreenResources *resources = XRRGetScreenResourcesCurrent(display, root_window);
+        for (int i = 0; resources && i < resources->ncrtc; i++) {
+            stats.round_trips++;
+            XRRCrtcInfo *crtc = XRRGetCrtcInfo(display, resources, resources->crtcs[i]);
+            if (!crtc)
+                continue;
+            // A CRTC without a mode or outputs is switched off
+            if (crtc->mode != None && crtc->noutput > 0)
+                crtcs.push_back({crtc->x, crtc->y, crtc->x + (int) crtc->width, crtc->y + (int) crtc->height});
+            XRRFreeCrtcInfo(crtc);
+        }
+        if (resources)
+            XRRFreeScreenResources(resources);
+    }
+
+    // Mirrored monitors show the same part of the root, we only need to present it once.
+    // A mirror can be a smaller mode showing only part of a bigger one, so the biggest go first
+    // and every CRTC that one we kept already covers is left out, whatever order the server listed them in
+    std::stable_sort(crtcs.begin(), crtcs.end(), [](const Region_Box &a, const Region_Box &b) {
+        return (long) (a.x2 - a.x1) * (a.y2 - a.y1) > (long) (b.x2 - b.x1) * (b.y2 - b.y1);
+    });
+    for (const Region_Box &box : crtcs) {
+        bool duplicate = false;
+        for (const Region_Box &other : monitors)
+            duplicate = duplicate || (other.x1 <= box.x1 && other.y1 <= box.y1 &&
+                                      other.x2 >= box.x2 && other.y2 >= box.y2);
+        if (!duplicate)
+            monitors.push_back(box);
+    }
+    if (monitors.empty())
+        monitors.push_back({0, 0, root_width, root_height});
+
+    monitor_area.clear();
+    for (const Region_Box &monitor : monitors)
+        monitor_area.unite(Banded_Region(monitor));
+    monitor_area.intersect(Banded_Region(0, 0, root_width, root_height));
+    monitors_changed = false;
+}
+
+// A window can skip the compositor and draw straight to the screen when nothing of what we'd draw would show:
+// it's the topmost window that's mapped, it's SOLID, it's not shaped, and it covers the whole root.
+// That's what games, video players and fullscreen dashboards look like, and compositing them
+// costs a full screen composite and present every frame for nothing.
+//
+// We only unredirect after the window has stayed like that for unredirect_delay_us,
+// but go back to compositing the moment anything changes,
+// so a window that keeps popping up over it can't make us flip back and forth every frame.
+//
+Client *find_fullscreen_client() {
+    for (Client *w = clients.top; w; w = w->below) {
+        // We can't tell whether a window we haven't heard back about yet is on top
+        if (w->attributes_pending)
+            return nullptr;
+        if (w->attr.map_state != IsViewable)
+            continue;
+        bool covers_root = w->attr.x <= 0 && w->attr.y <= 0 &&
+                           w->attr.x + w->attr.width + w->attr.border_width * 2 >= root_width &&
+                           w->attr.y + w->attr.height + w->attr.border_width * 2 >= root_height;
+        if (covers_root && !w->shaped && w->opaqueness == Window_Opaqueness::SOLID)
+            return w;
+        return nullptr;
+    }
+    return nullptr;
+}
+
+// Takes the unredirected window back into the compositor and repaints the whole screen, since it's all stale
+void redirect_fullscreen_window() {
+    if (!unredirected_window)
+        return;
+    track_window_request(unredirected_window);
+    XCompositeRedirectWindow(display, unredirected_window, CompositeRedirectManual);
+    unredirected_window = 0;
+    if (present_enabled)
+        set_overlay_visible(true);
+    add_damage(Banded_Region(0, 0, root_width, root_height));
+}
+
+void update_unredirection(uint64_t now) {
+    if (!unredirect_enabled)
+        return;
+    Client *fullscreen = find_fullscreen_client();
+    Window window = fullscreen ? fullscreen->window : 0;
+    if (window != fullscreen_window) {
+        fullscreen_window = window;
+        fullscreen_since_us = now;
+    }
+    if (unredirected_window && unredirected_window != window)
+        redirect_fullscreen_window();
+    if (!fullscreen || unredirected_window || now - fullscreen_since_us < unredirect_delay_us)
+        return;
+
+    // Redirection gives the window a new pixmap when it comes back, so the one we have is of no use anymore
+    release_client_pixmap(fullscreen);
+    track_window_request(window);
+    XCompositeUnredirectWindow(display, window, CompositeRedirectManual);
+    if (present_enabled)
+        set_overlay_visible(false);
+    unredirected_window = window;
+    stats.unredirections++;
+}
+
+// When update_unredirection has to run again even if no events come in, 0 if it doesn't
+uint64_t next_unredirection_check() {
+    if (!unredirect_enabled || !fullscreen_window || unredirected_window)
+        return 0;
+    return fullscreen_since_us + unredirect_delay_us;
+}
+
+void finish_unmap_client(Client *client) {
+    client->damaged = 0;
+    paint_list.update(client);
+    if (client->window == unredirected_window)
+        redirect_fullscreen_window();
+
+    if (!client->extents.empty()) {
+        add_damage(client->extents);
+        client->extents.clear();
+    }
+
+    release_client_pixmap(client);
+
+    /* don't care about properties anymore */
+    track_window_request(client->window);
+    XSelectInput(display, client->window, 0);
+
+    client->border_size_valid = false;
+    client->border_clip.clear();
+}
+
+Client *get_client_from_window(Window id) {
+    return clients.find(id);
+}
+
+void unmap_win(Window window) {
+    Client *client = get_client_from_window(window);
+    if (!client) return;
+    client->attr.map_state = IsUnmapped;
+
+    finish_unmap_client(client);
+}
+
+// _NET_WM_WINDOW_OPACITY goes from 0 to 0xffffffff, we only keep the top 8 bits
+int opacity_level_from_property(const xcb_get_property_reply_t *property) {
+    if (!property || property->type != XA_CARDINAL || property->format != 32 || property->value_len != 1)
+        return opaque_level;
+    return *(const uint32_t *) xcb_get_property_value(property) >> 24;
+}
+
+// level is the window's _NET_WM_WINDOW_OPACITY (see opacity_level_from_property)
+void determine_opaqueness(Client *client, int level) {
+    XRenderPictFormat *format = nullptr;
+    if (client->attr.c_class != InputOnly)
+        format = find_visual_format(client->attr.visual);
+    else
+        level = opaque_level;
+    client->opacity_level = level;
+
+    // Fully opaque windows stay SOLID so they keep hiding whatever is below them
+    Window_Opaqueness opaqueness;
+    if (format && format->type == PictTypeDirect && format->direct.alphaMask) {
+        opaqueness = Window_Opaqueness::ARGB;
+    } else if (level != opaque_level) {
+        opaqueness = Window_Opaqueness::TRANSPARENT;
+    } else {
+        opaqueness = Window_Opaqueness::SOLID;
+    }
+    client->opaqueness = opaqueness;
+    if (!client->extents.empty())
+        add_damage(client->extents);
+}
+
+// Handling an event never waits on the server.
+// When we need to know something about a window we send the request through XCB, which hands back a cookie
+// right away, and resolve_pending_replies picks the answers up once they are in.
+// Answers come back in the order the requests were sent, so both queues are resolved front to back.
+//
+// A window we're still waiting on is attributes_pending: it's already in the stacking order,
+// so events about it are handled as usual, but it has no damage object yet and so is never painted.
+//
+struct Pending_Client {
+    Window window;
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_geometry_cookie_t geometry;
+    xcb_shape_query_extents_cookie_t shape;
+    xcb_get_property_cookie_t opacity;
+    xcb_get_property_cookie_t damage_hz;
+};
+std::deque<Pending_Client> pending_clients;
+
+// A property we watch that changed, see resolve_property
+struct Pending_Property {
+    Window window;
+    Atom atom;
+    xcb_get_property_cookie_t cookie;
+};
+std::deque<Pending_Property> pending_properties;
+
+// _NET_ACTIVE_WINDOW is usually a window inside the frame the window manager put around it,
+// while we only know the frames, the children of the root.
+// So we walk up from it to the root, one QueryTree at a time, and never wait for them (see find_active_window).
+//
+struct Pending_Tree {
+    Window window;
+    xcb_query_tree_cookie_t cookie;
+};
+std::deque<Pending_Tree> pending_trees;
+
+xcb_connection_t *xcb_connection;
+
+void request_property(Window window, Atom atom, Atom type) {
+    Pending_Property pending;
+    pending.window = window;
+    pending.atom = atom;
+    pending.cookie = xcb_get_property(xcb_connection, false, window, atom, type, 0, 1);
+    pending_properties.push_back(pending);
+}
+
+// Asks for the window's _NET_WM_WINDOW_OPACITY, determine_opaqueness is called once it's in
+void request_opacity(Client *client) {
+    // The window's own answer will have it
+    if (client->attributes_pending)
+        return;
+    request_property(client->window, opacity_atom, XA_CARDINAL);
+}
+
+// _XCOMPMGR_DAMAGE_HZ is a CARDINAL, 0 or missing means the window goes by -D
+unsigned int damage_hz_from_property(const xcb_get_property_reply_t *property) {
+    if (!property || property->type != XA_CARDINAL || property->format != 32 || property->value_len != 1)
+        return 0;
+    return *(const uint32_t *) xcb_get_property_value(property);
+}
+
+void find_active_window(Window window) {
+    if (!window || window == root_window || get_client_from_window(window)) {
+        active_window = window == root_window ? 0 : window;
+        return;
+    }
+    Pending_Tree pending;
+    pending.window = window;
+    pending.cookie = xcb_query_tree(xcb_connection, window);
+    pending_trees.push_back(pending);
+}
+
+void resolve_property(const Pending_Property &pending, xcb_get_property_reply_t *property) {
+    if (pending.atom == active_window_atom) {
+        bool valid = property && property->type == XA_WINDOW && property->format == 32 && property->value_len == 1;
+        find_active_window(valid ? *(const uint32_t *) xcb_get_property_value(property) : 0);
+        return;
+    }
+    Client *client = get_client_from_window(pending.window);
+    if (!client || !property)
+        return;
+    if (pending.atom == opacity_atom) {
+        determine_opaqueness(client, opacity_level_from_property(property));
+        if (event_record_file)
+            record_opacity(client->window, client->opacity_level);
+    }
+    else if (pending.atom == damage_hz_atom)
+        client->max_damage_hz = damage_hz_from_property(property);
+}
+
+void map_win(Window window) {
+    Client *client = get_client_from_window(window);
+
+    if (!client) return;
+
+    client->attr.map_state = IsViewable;
+
+    // So we hear about _NET_WM_WINDOW_OPACITY changing
+    track_window_request(window);
+    XSelectInput(display, window, PropertyChangeMask);
+
+    request_opacity(client);
+    client->damaged = 0;
+    client->extents = client_extents(client);
+    paint_list.update(client);
+}
+
+// Starts tracking a window. Everything we need to know about it is asked for here
+// and filled in by resolve_client once the answers are in.
+//
+void add_client(Window window) {
+    // A window reparented back to the root can still be known to us
+    if (get_client_from_window(window))
+        return;
+    // The overlay (-P) is a child of the root too, but it's where we draw
+    if (overlay_window && window == overlay_window)
+        return;
+
+    Client *client = client_pool.acquire();
+
+    client->window = window;
+    client->attributes_pending = true;
+    memset(&client->attr, 0, sizeof(client->attr));
+    client->attr.map_state = IsUnmapped;
+    client->opaqueness = Window_Opaqueness::SOLID;
+    client->shaped = false;
+    client->shape_bounds = XRectangle();
+    client->damaged = 0;
+    client->pixmap = 0;
+    client->picture = 0;
+    client->damage = 0;
+    client->pixmap_generation = ++pixmap_generations;
+    client->opacity_level = opaque_level;
+    client->border_size_valid = false;
+    client->shape_valid = false;
+    client->damage_dirty = false;
+    client->max_damage_hz = 0;
+    client->damage_honoured_us = 0;
+    client->damage_events = 0;
+    client->damage_deferrals = 0;
+    client->damage_rate = 0;
+    client->deferral_rate = 0;
+    client->paint_index = -1;
+    client->thumbnail_stale = true;
+
+    client->above = nullptr;
+    client->below = nullptr;
+    clients.push_top(client);
+
+    // Listen first, so nothing that changes between now and the answers gets lost
+    track_window_request(window);
+    XSelectInput(display, window, PropertyChangeMask);
+    track_window_request(window);
+    XShapeSelectInput(display, window, ShapeNotifyMask);
+
+    Pending_Client pending;
+    pending.window = window;
+    pending.attributes = xcb_get_window_attributes(xcb_connection, window);
+    pending.geometry = xcb_get_geometry(xcb_connection, window);
+    pending.shape = xcb_shape_query_extents(xcb_connection, window);
+    pending.opacity = xcb_get_property(xcb_connection, false, window, opacity_atom, XA_CARDINAL, 0, 1);
+    pending.damage_hz = xcb_get_property(xcb_connection, false, window, damage_hz_atom, XA_CARDINAL, 0, 1);
+    pending_clients.push_back(pending);
+}
+
+// Xlib hands out Visual pointers, the protocol only has the id
+Visual *find_visual(VisualID id) {
+    static std::unordered_map<VisualID, Visual *> visuals;
+    if (visuals.empty()) {
+        for (int s = 0; s < ScreenCount(display); s++) {
+            Screen *screen = ScreenOfDisplay(display, s);
+            for (int d = 0; d < screen->ndepths; d++) {
+                for (int v = 0; v < screen->depths[d].nvisuals; v++)
+                    visuals[screen->depths[d].visuals[v].visualid] = &screen->depths[d].visuals[v];
+            }
+        }
+    }
+    auto found = visuals.find(id);
+    return found == visuals.end() ? nullptr : found->second;
+}
+
+// Fills in a client added by add_client with the answers about its window
+void resolve_client(const Pending_Client &pending,
+                    xcb_get_window_attributes_reply_t *attributes,
+                    xcb_get_geometry_reply_t *geometry,
+                    xcb_shape_query_extents_reply_t *shape,
+                    xcb_get_property_reply_t *opacity,
+                    xcb_get_property_reply_t *damage_hz) {
+    // It could have been destroyed while we were waiting
+    Client *client = get_client_from_window(pending.window);
+    if (!client || !client->attributes_pending)
+        return;
+
+    // The window was gone before it got to our requests, its DestroyNotify is on the way
+    if (!attributes || !geometry) {
+        clients.remove(client);
+        client_pool.release(client);
+        return;
+    }
+
+    // The same thing XGetWindowAttributes puts together out of these two replies.
+    // Events about the window from before our requests were already handled, so these are the newest values.
+    XWindowAttributes &attr = client->attr;
+    attr.x = geometry->x;
+    attr.y = geometry->y;
+    attr.width = geometry->width;
+    attr.height = geometry->height;
+    attr.border_width = geometry->border_width;
+    attr.depth = geometry->depth;
+    attr.visual = find_visual(attributes->visual);
+    attr.root = geometry->root;
+    attr.c_class = attributes->_class;
+    attr.bit_gravity = attributes->bit_gravity;
+    attr.win_gravity = attributes->win_gravity;
+    attr.backing_store = attributes->backing_store;
+    attr.backing_planes = attributes->backing_planes;
+    attr.backing_pixel = attributes->backing_pixel;
+    attr.save_under = attributes->save_under;
+    attr.colormap = attributes->colormap;
+    attr.map_installed = attributes->map_is_installed;
+    attr.map_state = attributes->map_state;
+    attr.all_event_masks = attributes->all_event_masks;
+    attr.your_event_mask = attributes->your_event_mask;
+    attr.do_not_propagate_mask = attributes->do_not_propagate_mask;
+    attr.override_redirect = attributes->override_redirect;
+    attr.screen = ScreenOfDisplay(display, default_screen);
+    client->attributes_pending = false;
+    client->max_damage_hz = damage_hz_from_property(damage_hz);
+
+    client->shape_bounds.x = attr.x;
+    client->shape_bounds.y = attr.y;
+    client->shape_bounds.width = attr.width;
+    client->shape_bounds.height = attr.height;
+
+    if (attr.c_class != InputOnly) {
+        track_window_request(client->window);
+        client->damage = XDamageCreate(display, client->window, XDamageReportDeltaRectangles);
+
+        // We only ask the server for the shape of shaped windows (see get_border_size)
+        // so we need to know which windows were already shaped before we started listening
+        if (shape && shape->bounding_shaped) {
+            client->shaped = true;
+            client->shape_bounds.x = attr.x + shape->bounding_shape_extents_x;
+            client->shape_bounds.y = attr.y + shape->bounding_shape_extents_y;
+            client->shape_bounds.width = shape->bounding_shape_extents_width;
+            client->shape_bounds.height = shape->bounding_shape_extents_height;
+        }
+    }
+
+    if (attr.map_state == IsViewable) {
+        client->extents = client_extents(client);
+        determine_opaqueness(client, opacity_level_from_property(opacity));
+    }
+    paint_list.update(client);
+    if (event_record_file)
+        record_window(client, opacity_level_from_property(opacity));
+}
+
+// Picks up the answers to the requests add_client, request_property and find_active_window sent.
+// With wait false it only takes the ones that already arrived, with wait true it waits for all of them.
+//
+void resolve_pending_replies(bool wait) {
+    if (wait && (!pending_clients.empty() || !pending_properties.empty() || !pending_trees.empty()))
+        stats.round_trips++;
+    while (!pending_clients.empty()) {
+        const Pending_Client &pending = pending_clients.front();
+        xcb_get_property_reply_t *damage_hz = nullptr;
+        xcb_generic_error_t *error = nullptr;
+        if (wait) {
+            damage_hz = xcb_get_property_reply(xcb_connection, pending.damage_hz, nullptr);
+        } else {
+            // _XCOMPMGR_DAMAGE_HZ was asked for last, so when its answer is in, all of them are
+            if (!xcb_poll_for_reply(xcb_connection, pending.damage_hz.sequence, (void **) &damage_hz, &error))
+                break;
+            free(error);
+        }
+        xcb_get_property_reply_t *opacity = xcb_get_property_reply(xcb_connection, pending.opacity, nullptr);
+        xcb_get_window_attributes_reply_t *attributes =
+                xcb_get_window_attributes_reply(xcb_connection, pending.attributes, nullptr);
+        xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(xcb_connection, pending.geometry, nullptr);
+        xcb_shape_query_extents_reply_t *shape = xcb_shape_query_extents_reply(xcb_connection, pending.shape,
+                                                                               nullptr);
+        resolve_client(pending, attributes, geometry, shape, opacity, damage_hz);
+        free(attributes);
+        free(geometry);
+        free(shape);
+        free(opacity);
+        free(damage_hz);
+        pending_clients.pop_front();
+    }
+
+    while (!pending_properties.empty()) {
+        const Pending_Property &pending = pending_properties.front();
+        xcb_get_property_reply_t *property = nullptr;
+        xcb_generic_error_t *error = nullptr;
+        if (wait) {
+            property = xcb_get_property_reply(xcb_connection, pending.cookie, nullptr);
+        } else {
+            if (!xcb_poll_for_reply(xcb_connection, pending.cookie.sequence, (void **) &property, &error))
+                break;
+            free(error);
+        }
+        resolve_property(pending, property);
+        free(property);
+        pending_properties.pop_front();
+    }
+
+    // (resolving one can send the next one, for the parent)
+    while (!pending_trees.empty()) {
+        Pending_Tree pending = pending_trees.front();
+        xcb_query_tree_reply_t *tree = nullptr;
+        xcb_generic_error_t *error = nullptr;
+        if (wait) {
+            tree = xcb_query_tree_reply(xcb_connection, pending.cookie, nullptr);
+        } else {
+            if (!xcb_poll_for_reply(xcb_connection, pending.cookie.sequence, (void **) &tree, &error))
+                break;
+            free(error);
+        }
+        pending_trees.pop_front();
+        if (!tree)
+            active_window = 0; // it's gone already
+        else if (tree->parent == root_window)
+            active_window = pending.window;
+        else
+            find_active_window(tree->parent);
+        free(tree);
+    }
+}
+
+// Adds every window that already exists, at startup.
+//
+// They all go through add_client, which sends every query at once without waiting for the answers,
+// so the whole scan costs two round trips (the tree and the answers) no matter how many windows there are.
+// The grab only makes sure no window changes between the tree and the answers.
+//
+void add_existing_clients() {
+    uint64_t grab_start = monotonic_us();
+    XGrabServer(display);
+
+    Window *children;
+    unsigned int children_count;
+    Window root_return, parent_return;
+    stats.round_trips++;
+    if (XQueryTree(display, root_window, &root_return, &parent_return, &children, &children_count)) {
+        for (unsigned int i = 0; i < children_count; i++)
+            add_client(children[i]);
+        XFree(children);
+    }
+    resolve_pending_replies(true);
+
+    XUngrabServer(display);
+    XFlush(display);
+    startup_grab_us = monotonic_us() - grab_start;
+}
+
+// Thumbnails (-L socket, see thumbnail.h)
+// Other programs ask for the thumbnail of a window over a unix socket and get the id of a pixmap we keep for it.
+// It's drawn with a single composite from the window's pixmap, scaled down by the server
+// with a transform on the source picture, and only when the window was damaged since it was last drawn.
+//
+// The reply can't go out before the server actually drew it, or whoever asked could read it half done.
+// Waiting on the server is out for the event thread, so after drawing we send a GetInputFocus,
+// whose answer comes after everything sent before it is done, and reply once it's in (see send_thumbnail_replies).
+// Replies go out in the order the requests came in, a reply that doesn't wait on anything waits behind those that do.
+//
+struct Thumbnail {
+    Pixmap pixmap;
+    Picture picture;
+    int width, height;
+};
+std::unordered_map<Window, Thumbnail> thumbnails;
+const int max_thumbnail_size = 1024; // on either side, so nobody can have us keep a full size copy of every window
+// On either side of the kernel that averages the window down, so a tiny thumbnail of a huge window
+// doesn't send the server a kernel the size of the window. Past that it only averages part of each box
+const int max_thumbnail_kernel_size = 64;
+const char *thumbnail_socket_path; // -L
+int thumbnail_listen_fd = -1;
+std::vector<int> thumbnail_connections;
+
+struct Pending_Thumbnail_Reply {
+    int connection; // -1 once the connection is closed
+    Thumbnail_Reply reply;
+    bool drawn; // cookie is for the GetInputFocus sent after drawing it
+    xcb_get_input_focus_cookie_t cookie;
+};
+std::deque<Pending_Thumbnail_Reply> pending_thumbnail_replies;
+
+void free_thumbnail(Window window) {
+    auto found = thumbnails.find(window);
+    if (found == thumbnails.end())
+        return;
+    free_picture(found->second.picture);
+    free_pixmap(found->second.pixmap);
+    thumbnails.erase(found);
+}
+
+// Draws the whole window, borders included, into its thumbnail
+void draw_thumbnail(Client *client, const Thumbnail &thumbnail) {
+    // With -p the window's pixmap belongs to the paint thread, so we name one of our own just for this
+    Pixmap pixmap;
+    if (paint_thread_enabled) {
+        track_window_request(client->window);
+        pixmap = XCompositeNameWindowPixmap(display, client->window);
+        live_pixmaps++;
+    } else {
+        name_client_pixmap(client);
+        pixmap = client->pixmap;
+    }
+    int width = client->attr.width + client->attr.border_width * 2;
+    int height = client->attr.height + client->attr.border_width * 2;
+
+    // A picture of its own, so the one paint_client uses keeps its identity transform.
+    // The edge pixels are repeated outward, or the kernel below would darken the border of the thumbnail
+    track_window_request(client->window);
+    XRenderPictureAttributes pa;
+    pa.repeat = RepeatPad;
+    Picture source = create_picture(pixmap, find_visual_format(client->attr.visual), CPRepeat, &pa);
+    // The transform takes a pixel of the thumbnail to where it is in the window
+    double scale_x = (double) width / thumbnail.width;
+    double scale_y = (double) height / thumbnail.height;
+    XTransform transform = {{
+            {XDoubleToFixed(scale_x), 0, 0},
+            {0, XDoubleToFixed(scale_y), 0},
+            {0, 0, XDoubleToFixed(1)},
+    }};
+    XRenderSetPictureTransform(display, source, &transform);
+    // and a box kernel the size of one thumbnail pixel in the window averages all the window pixels under it.
+    // FilterGood only blends the few around where it lands, so scaled down a lot it skips most of the window and aliases.
+    // The weights add up to exactly 1, so an opaque window stays opaque
+    int kernel_width = std::min((int) ceil(scale_x), max_thumbnail_kernel_size);
+    int kernel_height = std::min((int) ceil(scale_y), max_thumbnail_kernel_size);
+    int taps = kernel_width * kernel_height;
+    std::vector<XFixed> kernel(2 + taps);
+    kernel[0] = XDoubleToFixed(kernel_width);
+    kernel[1] = XDoubleToFixed(kernel_height);
+    for (int i = 0; i < taps; i++)
+        kernel[2 + i] = XDoubleToFixed(1) / taps + (i < XDoubleToFixed(1) % taps);
+    XRenderSetPictureFilter(display, source, FilterConvolution, kernel.data(), kernel.size());
+    XRenderComposite(display, PictOpSrc, source, 0, thumbnail.picture,
+                     0, 0, 0, 0, 0, 0, thumbnail.width, thumbnail.height);
+    free_picture(source);
+    if (paint_thread_enabled)
+        free_pixmap(pixmap);
+    stats.composites++;
+    stats.composited_pixels += thumbnail.width * thumbnail.height;
+    stats.thumbnails_drawn++;
+    client->thumbnail_stale = false;
+}
+
+void send_thumbnail_reply(int connection, const Thumbnail_Reply &reply) {
+    // A full socket or one closed on the other end is its problem, we never wait on it
+    if (connection >= 0)
+        send(connection, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void handle_thumbnail_request(int connection, const Thumbnail_Request &request) {
+    stats.thumbnail_requests++;
+    Pending_Thumbnail_Reply pending = {};
+    pending.connection = connection;
+    Thumbnail_Reply &reply = pending.reply;
+    reply.window = request.window;
+    reply.status = THUMBNAIL_OK;
+
+    Client *client = get_client_from_window(request.window);
+    // What a window looks like is only there while it's shown, after that the last thumbnail is as good as it gets
+    bool shown = client && !client->attributes_pending && client->attr.c_class != InputOnly &&
+                 client->attr.map_state == IsViewable && client->damaged && client->window != unredirected_window;
+    auto found = thumbnails.find(request.window);
+    if (request.version != thumbnail_socket_version || !request.max_width || !request.max_height) {
+        reply.status = THUMBNAIL_BAD_REQUEST;
+    } else if (!client) {
+        reply.status = THUMBNAIL_UNKNOWN_WINDOW;
+    } else if (!shown && found == thumbnails.end()) {
+        reply.status = THUMBNAIL_NOT_SHOWN;
+    } else if (shown) {
+        // As big as fits in the box, keeping the window's shape
+        int width = client->attr.width + client->attr.border_width * 2;
+        int height = client->attr.height + client->attr.border_width * 2;
+        int max_width = std::min<int>(request.max_width, max_thumbnail_size);
+        int max_height = std::min<int>(request.max_height, max_thumbnail_size);
+        double scale = std::min(1.0, std::min((double) max_width / width, (double) max_height / height));
+        int thumbnail_width = std::max(1, std::min(max_width, (int) lround(width * scale)));
+        int thumbnail_height = std::max(1, std::min(max_height, (int) lround(height * scale)));
+
+        if (found != thumbnails.end() &&
+            (found->second.width != thumbnail_width || found->second.height != thumbnail_height)) {
+            free_thumbnail(request.window);
+            found = thumbnails.end();
+        }
+        if (found == thumbnails.end()) {
+            Thumbnail thumbnail;
+            thumbnail.width = thumbnail_width;
+            thumbnail.height = thumbnail_height;
+            thumbnail.pixmap = create_pixmap(thumbnail_width, thumbnail_height, 32);
+            thumbnail.picture = create_picture(thumbnail.pixmap, XRenderFindStandardFormat(display, PictStandardARGB32),
+                                               0, nullptr);
+            found = thumbnails.emplace(request.window, thumbnail).first;
+            client->thumbnail_stale = true;
+        }
+        if (client->thumbnail_stale) {
+            draw_thumbnail(client, found->second);
+            reply.refreshed = 1;
+            pending.drawn = true;
+            pending.cookie = xcb_get_input_focus(xcb_connection);
+        }
+    }
+    if (reply.status == THUMBNAIL_OK) {
+        reply.pixmap = found->second.pixmap;
+        reply.width = found->second.width;
+        reply.height = found->second.height;
+    }
+
+    if (pending.drawn || !pending_thumbnail_replies.empty())
+        pending_thumbnail_replies.push_back(pending);
+    else
+        send_thumbnail_reply(connection, reply);
+}
+
+// Sends the replies whose thumbnails the server has drawn by now
+void send_thumbnail_replies() {
+    while (!pending_thumbnail_replies.empty()) {
+        const Pending_Thumbnail_Reply &pending = pending_thumbnail_replies.front();
+        if (pending.drawn) {
+            xcb_get_input_focus_reply_t *focus = nullptr;
+            xcb_generic_error_t *error = nullptr;
+            if (!xcb_poll_for_reply(xcb_connection, pending.cookie.sequence, (void **) &focus, &error))
+                break;
+            free(focus);
+            free(error);
+        }
+        send_thumbnail_reply(pending.connection, pending.reply);
+        pending_thumbnail_replies.pop_front();
+    }
+}
+
+void open_thumbnail_socket() {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(thumbnail_socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The thumbnail socket path is too long\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, thumbnail_socket_path);
+    thumbnail_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (thumbnail_listen_fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    // One left behind by a compositor that didn't get to clean up would be in the way
+    unlink(thumbnail_socket_path);
+    if (bind(thumbnail_listen_fd, (sockaddr *) &address, sizeof(address)) < 0 || listen(thumbnail_listen_fd, 16) < 0) {
+        perror(thumbnail_socket_path);
+        exit(1);
+    }
+}
+
+void close_thumbnail_socket() {
+    if (thumbnail_listen_fd < 0)
+        return;
+    for (int connection : thumbnail_connections)
+        close(connection);
+    thumbnail_connections.clear();
+    close(thumbnail_listen_fd);
+    thumbnail_listen_fd = -1;
+    unlink(thumbnail_socket_path);
+}
+
+void accept_thumbnail_connections() {
+    int connection;
+    while ((connection = accept4(thumbnail_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        thumbnail_connections.push_back(connection);
+}
+
+// Handles every request waiting on the connection, false once the other end closed it
+bool read_thumbnail_requests(int connection) {
+    while (true) {
+        Thumbnail_Request request = {};
+        ssize_t size = recv(connection, &request, sizeof(request), 0);
+        if (size == 0)
+            return false;
+        if (size < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (size != sizeof(request))
+            request.version = 0;
+        handle_thumbnail_request(connection, request);
+    }
+}
+
+void close_thumbnail_connection(int connection) {
+    close(connection);
+    thumbnail_connections.erase(std::find(thumbnail_connections.begin(), thumbnail_connections.end(), connection));
+    // The number can be handed out again to the next connection, which must not get these
+    for (Pending_Thumbnail_Reply &pending : pending_thumbnail_replies) {
+        if (pending.connection == connection)
+            pending.connection = -1;
+    }
+}
+
+void restack_win(Client *moving_client, Window target_window) {
+    //  The moving_client wants to be placed in front of the target_window and we shall do just that.
+    //  A target_window of 0 means the moving client wants to go to the bottom of the list
+    //
+    clients.place_above(moving_client, target_window);
+}
+
+void configure_client(XConfigureEvent *ce) {
+    Client *client = get_client_from_window(ce->window);
+
+    if (client == nullptr) {
+        if (ce->window == root_window) {
+            // (the paint thread notices the new size in the next snapshot)
+            if (!paint_thread_enabled)
+                free_back_buffers();
+            root_width = ce->width;
+            root_height = ce->height;
+            monitors_changed = true;
+            add_damage(Banded_Region(0, 0, root_width, root_height));
+        }
+        return;
+    }
+
+    Banded_Region damage = client->extents;
+
+    // Only this window's regions change, and when it just moved they only need to be moved along with it.
+    // The shape is relative to the inside of the border, so it moves with that.
+    int dx = ce->x - client->attr.x;
+    int dy = ce->y - client->attr.y;
+    int shape_dx = dx + ce->border_width - client->attr.border_width;
+    int shape_dy = dy + ce->border_width - client->attr.border_width;
+    bool resized = client->attr.width != ce->width || client->attr.height != ce->height ||
+                   client->attr.border_width != ce->border_width;
+    if (client->shape_valid)
+        client->shape.translate(shape_dx, shape_dy);
+    if (resized)
+        client->border_size_valid = false;
+    else if (client->border_size_valid)
+        client->border_size.translate(dx, dy);
+
+    client->shape_bounds.x -= client->attr.x;
+    client->shape_bounds.y -= client->attr.y;
+    client->attr.x = ce->x;
+    client->attr.y = ce->y;
+    if (client->attr.width != ce->width || client->attr.height != ce->height)
+        release_client_pixmap(client);
+    client->attr.width = ce->width;
+    client->attr.height = ce->height;
+    client->attr.border_width = ce->border_width;
+    client->attr.override_redirect = ce->override_redirect;
+    paint_list.update(client);
+
+    restack_win(client, ce->above);
+
+    if (!client->extents.empty())
+        client->extents = client_extents(client);
+    damage.unite(client_extents(client));
+    add_damage(damage);
+    client->shape_bounds.x += client->attr.x;
+    client->shape_bounds.y += client->attr.y;
+    if (!client->shaped) {
+        client->shape_bounds.width = client->attr.width;
+        client->shape_bounds.height = client->attr.height;
+    }
+}
+
+void circulate_client(XCirculateEvent *ce) {
+    Client *client = get_client_from_window(ce->window);
+
+    if (!client) return;
+
+    if (ce->place == PlaceOnTop)
+        clients.move_to_top(client);
+    else
+        clients.move_to_bottom(client);
+    // Nothing to recompute, restacking only changes what ends up in each border_clip
+    if (!client->extents.empty())
+        add_damage(client->extents);
+}
+
+void destroy_win(Window window, bool gone) {
+    Client *w = get_client_from_window(window);
+
+    if (!w) return;
+
+    // There's nothing left to redirect, but what's under it still has to be painted
+    if (gone && w->window == unredirected_window) {
+        unredirected_window = 0;
+        add_damage(Banded_Region(0, 0, root_width, root_height));
+    }
+    if (gone)
+        finish_unmap_client(w);
+    free_pixmap(w->pixmap);
+    free_picture(w->picture);
+    if (w->damage != 0) {
+        XDamageDestroy(display, w->damage);
+        w->damage = 0;
+    }
+    free_thumbnail(w->window);
+    if (w->damage_dirty) {
+        auto held_back = std::find(held_back_clients.begin(), held_back_clients.end(), w);
+        if (held_back != held_back_clients.end())
+            held_back_clients.erase(held_back);
+        else
+            dirty_clients.erase(std::find(dirty_clients.begin(), dirty_clients.end(), w));
+    }
+    clients.remove(w);
+    client_pool.release(w);
+}
+
+void damage_client(XDamageNotifyEvent *de) {
+    Client *client = get_client_from_window(de->drawable);
+
+    if (!client) return;
+
+    stats.damage_events++;
+    client->damage_events++;
+
+    // The damage objects report every rectangle that got drawn to (XDamageReportDeltaRectangles)
+    // right in the event, so we don't need to ask the server for the damaged region.
+    // All we do here is collect the rectangles, acknowledge_damage hands them over once per frame.
+    //
+    if (!client->damaged) {
+        client->pending_damage = client_extents(client);
+    } else {
+        Banded_Region parts(de->area.x, de->area.y, de->area.width, de->area.height);
+        parts.translate(client->attr.x + client->attr.border_width,
+                        client->attr.y + client->attr.border_width);
+        client->pending_damage.unite(parts);
+        // A terminal or a video player can scatter so many rectangles that every frame would spend
+        // more time on the region than on drawing the whole window, so past a point we just draw all of it
+        if (client->pending_damage.box_count() >= max_pending_damage_boxes) {
+            client->pending_damage = client_extents(client);
+            stats.damage_collapses++;
+        }
+    }
+    if (!client->damage_dirty) {
+        client->damage_dirty = true;
+        dirty_clients.push_back(client);
+    }
+    client->damaged = 1;
+    client->thumbnail_stale = true;
+    paint_list.update(client);
+}
+
+// The most often a window's damage gets painted, 0 for no limit
+unsigned int damage_hz_limit(const Client *client) {
+    if (client->window == active_window)
+        return 0;
+    return client->max_damage_hz ? client->max_damage_hz : default_max_damage_hz;
+}
+
+// Once per frame, adds the damage of every window that reported some to all_damage
+// and resets their damage objects with one XDamageSubtract each.
+// The damage object doesn't report drawing to a part that's already damaged,
+// which is fine until the subtract: that part gets painted this frame anyway, after whatever was drawn to it.
+//
+// A window over its damage rate limit (_XCOMPMGR_DAMAGE_HZ or -D) keeps its damage until it's due again.
+// Since we don't subtract, its damage object keeps quiet about the parts already damaged,
+// so a spinner or a progress bar updating a thousand times a second costs us a few events a frame and a paint
+// every so often, instead of a paint every frame. The window the user is working in never waits.
+//
+void send_damage_subtracts(std::vector<Damage_Subtract> &subtracts) {
+    for (const Damage_Subtract &subtract : subtracts) {
+        track_window_request(subtract.window);
+        XDamageSubtract(display, subtract.damage, 0, 0);
+    }
+    subtracts.clear();
+}
+
+void acknowledge_damage() {
+    // The held back windows go first, they've been waiting the longest
+    dirty_clients.insert(dirty_clients.begin(), held_back_clients.begin(), held_back_clients.end());
+    held_back_clients.clear();
+    next_deferred_damage_us = 0;
+    uint64_t now = monotonic_us();
+
+    for (Client *client : dirty_clients) {
+        unsigned int limit = damage_hz_limit(client);
+        uint64_t due = limit ? client->damage_honoured_us + 1000000 / limit : 0;
+        if (now < due) {
+            held_back_clients.push_back(client);
+            client->damage_deferrals++;
+            stats.damage_deferrals++;
+            if (!next_deferred_damage_us || due < next_deferred_damage_us)
+                next_deferred_damage_us = due;
+            continue;
+        }
+        add_damage(client->pending_damage);
+        client->pending_damage.clear();
+        client->damage_dirty = false;
+        client->damage_honoured_us = now;
+        damage_subtracts.push_back({client->window, client->damage});
+        stats.damage_subtracts++;
+    }
+    dirty_clients.clear();
+    if (!paint_thread_enabled)
+        send_damage_subtracts(damage_subtracts);
+}
+
+// Whether any damage is waiting to be acknowledged right now, held back damage only counts once it's due
+bool damage_pending(uint64_t now) {
+    return !dirty_clients.empty() || (!held_back_clients.empty() && now >= next_deferred_damage_us);
+}
+
+void shape_win(XShapeEvent *se) {
+    Client *client = get_client_from_window(se->window);
+
+    if (!client) return;
+
+    if (se->kind == ShapeClip || se->kind == ShapeBounding) {
+        client->border_size_valid = false;
+        client->shape_valid = false;
+
+        Banded_Region damage = Banded_Region::from_rectangles(&client->shape_bounds, 1);
+
+        if (se->shaped) {
+            client->shaped = true;
+            client->shape_bounds.x = client->attr.x + se->x;
+            client->shape_bounds.y = client->attr.y + se->y;
+            client->shape_bounds.width = se->width;
+            client->shape_bounds.height = se->height;
+        } else {
+            client->shaped = false;
+            client->shape_bounds.x = client->attr.x;
+            client->shape_bounds.y = client->attr.y;
+            client->shape_bounds.width = client->attr.width;
+            client->shape_bounds.height = client->attr.height;
+        }
+
+        damage.unite(Banded_Region::from_rectangles(&client->shape_bounds, 1));
+
+        /* ask for repaint of the old and new region */
+        add_damage(damage);
+    }
+}
+
+int error_handler(Display *dpy, XErrorEvent *ev) {
+    // We aren't allowed to send requests from inside the error handler,
+    // so all we do is write down which window the failed request was about
+    // and handle_failed_requests cleans up after it once the events have been processed.
+    //
+    stats.errors++;
+    while (!window_requests.empty() && window_requests.front().sequence < ev->serial)
+        window_requests.pop_front();
+    if (!window_requests.empty() && window_requests.front().sequence == ev->serial) {
+        failed_windows.push_back(window_requests.front().window);
+        return 0;
+    }
+
+    char message[256];
+    XGetErrorText(dpy, ev->error_code, message, sizeof(message));
+    fprintf(stderr, "X error: %s (request %d.%d, resource 0x%lx)\n",
+            message, ev->request_code, ev->minor_code, ev->resourceid);
+    return 0;
+}
+
+// The window of the client most likely got destroyed while we were still sending requests about it,
+// so the pixmap, picture, and regions we created for it can't be trusted.
+// We throw them away, if the window still exists they get created again when it's next damaged
+// and if it doesn't a DestroyNotify is on its way.
+//
+void handle_failed_requests() {
+    for (Window window : failed_windows) {
+        Client *client = get_client_from_window(window);
+        if (!client || client->attr.map_state != IsViewable)
+            continue;
+        finish_unmap_client(client);
+    }
+    failed_windows.clear();
+}
+
+// The rectangles of the root Expose events we got so far, the buffer is reused for every batch
+std::vector<XRectangle> root_expose_rects;
+
+// How big the window model is, for the statistics.
+// The paint thread (-p) mustn't look at the model, so it gets these with every snapshot instead.
+//
+const int printed_offenders = 3;
+
+struct Model_Stats {
+    size_t live_clients;
+    size_t client_pool;
+    size_t expose_buffer;
+    Client_Damage_Stats worst[printed_offenders]; // the windows that damaged the most in the last second
+    int worst_count;
+};
+
+Model_Stats current_model_stats() {
+    Model_Stats model;
+    model.live_clients = client_pool.live_count();
+    model.client_pool = client_pool.capacity();
+    model.expose_buffer = root_expose_rects.capacity();
+    model.worst_count = std::min(worst_offender_count, printed_offenders);
+    std::copy(worst_offenders, worst_offenders + model.worst_count, model.worst);
+    return model;
+}
+
+// Adds up the counters, used to hand the event thread's statistics over to the paint thread
+void add_statistics(Statistics &to, const Statistics &from) {
+    to.frames += from.frames;
+    to.events += from.events;
+    to.damage_events += from.damage_events;
+    to.damage_subtracts += from.damage_subtracts;
+    to.damage_collapses += from.damage_collapses;
+    to.damage_deferrals += from.damage_deferrals;
+    to.damage_simplifications += from.damage_simplifications;
+    to.simplified_boxes += from.simplified_boxes;
+    to.regions_computed += from.regions_computed;
+    to.server_regions_created += from.server_regions_created;
+    to.composites += from.composites;
+    to.composited_pixels += from.composited_pixels;
+    to.requests += from.requests;
+    to.round_trips += from.round_trips;
+    to.errors += from.errors;
+    to.skipped_frames += from.skipped_frames;
+    to.candidate_windows += from.candidate_windows;
+    to.culled_windows += from.culled_windows;
+    to.culled_pixels += from.culled_pixels;
+    to.root_tiles_skipped += from.root_tiles_skipped;
+    to.repainted_pixels += from.repainted_pixels;
+    to.presented_pixels += from.presented_pixels;
+    to.monitors_presented += from.monitors_presented;
+    to.dead_space_pixels += from.dead_space_pixels;
+    to.unredirections += from.unredirections;
+    to.presents += from.presents;
+    to.present_flips += from.present_flips;
+    to.present_wait_us += from.present_wait_us;
+    to.present_timeouts += from.present_timeouts;
+    to.thumbnail_requests += from.thumbnail_requests;
+    to.thumbnails_drawn += from.thumbnails_drawn;
+}
+
+// How much of our memory is actually in RAM, so a long run can show it stays flat
+long resident_kb() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    long pages = 0;
+    if (fscanf(file, "%*d %ld", &pages) != 1)
+        pages = 0;
+    fclose(file);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void print_statistics(const Model_Stats &model) {
+    timeval now;
+    gettimeofday(&now, nullptr);
+    if (now.tv_sec == stats.last_print.tv_sec)
+        return;
+    double frames = stats.frames ? stats.frames : 1;
+    printf("frames=%lu requests_per_frame=%.1f round_trips_per_frame=%.1f errors=%lu skipped_frames=%lu"
+           " candidate_windows_per_frame=%.1f culled_windows_per_frame=%.1f culled_pixels_per_frame=%.0f root_tiles_skipped=%lu"
+           " repainted_pixels_per_frame=%.0f presented_pixels_per_frame=%.0f"
+           " damage_events=%lu damage_subtracts=%lu damage_collapses=%lu damage_deferrals=%lu"
+           " damage_simplifications=%lu simplified_boxes=%lu regions_per_frame=%.1f"
+           " presents=%lu present_flips=%lu present_wait_us=%.0f present_timeouts=%lu"
+           " thumbnail_requests=%lu thumbnails_drawn=%lu"
+           " monitors_presented_per_frame=%.2f dead_space_pixels=%lu unredirections=%lu live_clients=%zu client_pool=%zu expose_buffer=%zu live_pixmaps=%ld live_pictures=%ld rss_kb=%ld",
+           stats.frames, stats.requests / frames, stats.round_trips / frames, stats.errors, stats.skipped_frames,
+           stats.candidate_windows / frames, stats.culled_windows / frames, stats.culled_pixels / frames, stats.root_tiles_skipped,
+           stats.repainted_pixels / frames, stats.presented_pixels / frames,
+           stats.damage_events, stats.damage_subtracts, stats.damage_collapses, stats.damage_deferrals,
+           stats.damage_simplifications, stats.simplified_boxes, stats.regions_computed / frames,
+           stats.presents, stats.present_flips, stats.present_wait_us / (stats.presents ? (double) stats.presents : 1),
+           stats.present_timeouts, stats.thumbnail_requests, stats.thumbnails_drawn,
+           stats.monitors_presented / frames, stats.dead_space_pixels, stats.unredirections,
+           model.live_clients, model.client_pool, model.expose_buffer, live_pixmaps.load(), live_pictures.load(),
+           resident_kb());
+    // window:damage events:times held back, for the windows that damaged the most
+    for (int i = 0; i < model.worst_count; i++)
+        printf("%s0x%x:%u:%u", i ? "," : " worst_damage=", model.worst[i].window,
+               model.worst[i].damage_events, model.worst[i].deferrals);
+    printf("\n");
+    fflush(stdout);
+    stats = Statistics();
+    stats.last_print = now;
+}
+
+void expose_root(const std::vector<XRectangle> &rectangles) {
+    add_damage(Banded_Region::from_rectangles(rectangles.data(), rectangles.size()));
+}
+
+// Writes down the events that change what's on the screen, for xcompmgr-simple-replay
+void record_event(const XEvent *ev) {
+    Event_Record record = {};
+    switch (ev->type) {
+        case CreateNotify: {
+            const XCreateWindowEvent &create = ev->xcreatewindow;
+            record.type = RECORD_CREATE;
+            record.window = create.window;
+            record.x = create.x;
+            record.y = create.y;
+            record.width = create.width;
+            record.height = create.height;
+            record.border_width = create.border_width;
+            record.flags = create.override_redirect ? RECORD_OVERRIDE_REDIRECT : 0;
+            break;
+        }
+        case DestroyNotify:
+            record.type = RECORD_DESTROY;
+            record.window = ev->xdestroywindow.window;
+            break;
+        case MapNotify:
+            record.type = RECORD_MAP;
+            record.window = ev->xmap.window;
+            break;
+        case UnmapNotify:
+            record.type = RECORD_UNMAP;
+            record.window = ev->xunmap.window;
+            break;
+        case ConfigureNotify: {
+            const XConfigureEvent &configure = ev->xconfigure;
+            record.type = RECORD_CONFIGURE;
+            record.window = configure.window;
+            record.sibling = configure.above;
+            record.x = configure.x;
+            record.y = configure.y;
+            record.width = configure.width;
+            record.height = configure.height;
+            record.border_width = configure.border_width;
+            break;
+        }
+        case ReparentNotify:
+            record.type = RECORD_REPARENT;
+            record.window = ev->xreparent.window;
+            record.sibling = ev->xreparent.parent;
+            record.x = ev->xreparent.x;
+            record.y = ev->xreparent.y;
+            break;
+        case CirculateNotify:
+            record.type = RECORD_CIRCULATE;
+            record.window = ev->xcirculate.window;
+            record.value = ev->xcirculate.place;
+            break;
+        case Expose:
+            if (ev->xexpose.window != root_window)
+                return;
+            record.type = RECORD_EXPOSE;
+            record.window = root_window;
+            record.x = ev->xexpose.x;
+            record.y = ev->xexpose.y;
+            record.width = ev->xexpose.width;
+            record.height = ev->xexpose.height;
+            break;
+        default:
+            if (ev->type == damage_event + XDamageNotify) {
+                const XDamageNotifyEvent *damage = (const XDamageNotifyEvent *) ev;
+                record.type = RECORD_DAMAGE;
+                record.window = damage->drawable;
+                record.x = damage->area.x;
+                record.y = damage->area.y;
+                record.width = damage->area.width;
+                record.height = damage->area.height;
+                break;
+            }
+            if (ev->type == xshape_event + ShapeNotify) {
+                const XShapeEvent *shape = (const XShapeEvent *) ev;
+                if (shape->kind == ShapeBounding)
+                    record_shape(shape->window, shape->shaped, shape->x, shape->y, shape->width, shape->height);
+            }
+            return;
+    }
+    write_record(record);
+}
+
+// Events go through a table of handlers indexed by the event type.
+// Extension events get their type from the extension's base, so the table is filled in at startup
+// once we know those (see init_event_handlers).
+//
+typedef void (*Event_Handler)(XEvent *ev);
+const int event_type_count = 128; // event types are 7 bits, the top bit only says the event was sent by a client
+Event_Handler event_handlers[event_type_count];
+
+void handle_create_notify(XEvent *ev) {
+    add_client(ev->xcreatewindow.window);
+}
+
+void handle_configure_notify(XEvent *ev) {
+    configure_client(&ev->xconfigure);
+}
 
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, region);
-            XFixesSubtractRegion(display, region, region, w->border_size);
-            XRenderComposite(display, PictOpSrc, w->picture, 0, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        }
-        if (!w->border_clip) {
-            w->border_clip = XFixesCreateRegion(display, nullptr, 0);
-            XFixesCopyRegion(display, w->border_clip, region);
-        }
-    }
+void handle_destroy_notify(XEvent *ev) {
+    destroy_win(ev->xdestroywindow.window, true);
+}
 
-    XFixesSetPictureClipRegion(display, root_buffer, 0, 0, region);
+void handle_map_notify(XEvent *ev) {
+    map_win(ev->xmap.window);
+}
 
-    // This is the start of actually compositing the screen
-    // this composites the root_tile which is the background image of your computer to the root_buffer.
-    // If you didn't do this step, you would end up drawing the windows on top of themselves over and over
-    // leading to a trailing effect
-    //
-    paint_root();
+void handle_unmap_notify(XEvent *ev) {
+    unmap_win(ev->xunmap.window);
+}
 
-    // This is just a fancy for loop used in order to iterate through the clients list in reverse order.
-    // The reason we do this is because the clients list has the window
-    // that is at the top of the window hierarchy, at the front of the list.
-    // Therefore we have to composite the windows in reverse if we want the front item
-    // in the list to be rendered on top of all other windows.
-    //
-    for (int i = clients.size(); i--;) {
-        Client *w = clients[i];
-        XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
-
-        if (w->opaqueness == Window_Opaqueness::TRANSPARENT) {
-            int x, y, wid, hei;
-            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
-
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
-
-            XRenderComposite(display, PictOpOver, w->picture, w->alpha_pict, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        } else if (w->opaqueness == Window_Opaqueness::ARGB) {
-            int x, y, wid, hei;
-            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
-
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
-
-            XRenderComposite(display, PictOpOver, w->picture, w->alpha_pict, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        }
-        XFixesDestroyRegion(display, w->border_clip);
-        w->border_clip = 0;
-    }
-    XFixesDestroyRegion(display, region);
-    if (root_buffer != root_picture) {
-        XFixesSetPictureClipRegion(display, root_buffer, 0, 0, 0);
-        XRenderComposite(display, PictOpSrc, root_buffer, 0, root_picture,
-                         0, 0, 0, 0, 0, 0, root_width, root_height);
-    }
+void handle_reparent_notify(XEvent *ev) {
+    if (ev->xreparent.parent == root_window)
+        add_client(ev->xreparent.window);
+    else
+        destroy_win(ev->xreparent.window, false);
 }
 
-void add_damage(XserverRegion damage) {
-    if (all_damage) {
-        XFixesUnionRegion(display, all_damage, all_damage, damage);
-        XFixesDestroyRegion(display, damage);
-    } else
-        all_damage = damage;
+void handle_circulate_notify(XEvent *ev) {
+    circulate_client(&ev->xcirculate);
 }
 
-void finish_unmap_client(Client *client) {
-    client->damaged = 0;
+void handle_expose(XEvent *ev) {
+    if (ev->xexpose.window != root_window)
+        return;
 
-    if (client->extents != 0) {
-        add_damage(client->extents);    /* destroys region */
-        client->extents = 0;
-    }
+    XRectangle rect;
+    rect.x = ev->xexpose.x;
+    rect.y = ev->xexpose.y;
+    rect.width = ev->xexpose.width;
+    rect.height = ev->xexpose.height;
+    root_expose_rects.push_back(rect);
 
-    if (client->pixmap) {
-        XFreePixmap(display, client->pixmap);
-        client->pixmap = 0;
+    // The count equals the number of expose events left to come so we wait until there are
+    // zero left to redraw optimally
+    //
+    if (ev->xexpose.count == 0) {
+        expose_root(root_expose_rects);
+        root_expose_rects.clear();
     }
+}
 
-    if (client->picture) {
-        XRenderFreePicture(display, client->picture);
-        client->picture = 0;
+// Clients change properties all the time (clocks, progress bars, titles),
+// so this has to be cheap for the ones we don't care about: comparing a few atoms
+void handle_property_notify(XEvent *ev) {
+    Atom atom = ev->xproperty.atom;
+    if (atom == opacity_atom || atom == damage_hz_atom) {
+        Client *client = get_client_from_window(ev->xproperty.window);
+        if (client && atom == opacity_atom)
+            request_opacity(client);
+        else if (client && !client->attributes_pending)
+            request_property(client->window, damage_hz_atom, XA_CARDINAL);
+        return;
     }
-
-    /* don't care about properties anymore */
-    XSelectInput(display, client->window, 0);
-
-    if (client->border_size) {
-        XFixesDestroyRegion(display, client->border_size);
-        client->border_size = 0;
+    if (ev->xproperty.window != root_window)
+        return;
+    if (atom == active_window_atom) {
+        request_property(root_window, active_window_atom, XA_WINDOW);
+        return;
     }
-    if (client->border_clip) {
-        XFixesDestroyRegion(display, client->border_clip);
-        client->border_clip = 0;
+    for (int p = 0; p < background_prop_count; p++) {
+        if (atom == background_atoms[p] && paint_thread_enabled) {
+            XClearArea(display, root_window, 0, 0, 0, 0, true);
+            background_changed = true;
+            break;
+        }
+        if (atom == background_atoms[p] && (root_tile || !wallpaper.empty())) {
+            XClearArea(display, root_window, 0, 0, 0, 0, true);
+            free_picture(root_tile);
+            wallpaper.clear();
+            break;
+        }
     }
-
-    clip_changed = true;
 }
 
-Client *get_client_from_window(Window id) {
-    for (Client *client: clients)
-        if (client->window == id)
-            return client;
-    return nullptr;
+// A monitor was added, removed, moved, or changed resolution
+void handle_screen_change(XEvent *ev) {
+    XRRUpdateConfiguration(ev);
+    monitors_changed = true;
+    add_damage(Banded_Region(0, 0, root_width, root_height));
 }
 
-void unmap_win(Window window) {
-    Client *client = get_client_from_window(window);
-    if (!client) return;
-    client->attr.map_state = IsUnmapped;
+void handle_damage_notify(XEvent *ev) {
+    damage_client((XDamageNotifyEvent *) ev);
+}
 
-    finish_unmap_client(client);
+void handle_shape_notify(XEvent *ev) {
+    shape_win((XShapeEvent *) ev);
 }
 
-void determine_opaqueness(Client *client) {
-    XRenderPictFormat *format;
+void handle_generic_event(XEvent *ev) {
+    handle_present_event(ev);
+}
 
-    if (client->alpha_pict) {
-        XRenderFreePicture(display, client->alpha_pict);
-        client->alpha_pict = 0;
+void init_event_handlers() {
+    event_handlers[CreateNotify] = handle_create_notify;
+    event_handlers[ConfigureNotify] = handle_configure_notify;
+    event_handlers[DestroyNotify] = handle_destroy_notify;
+    event_handlers[MapNotify] = handle_map_notify;
+    event_handlers[UnmapNotify] = handle_unmap_notify;
+    event_handlers[ReparentNotify] = handle_reparent_notify;
+    event_handlers[CirculateNotify] = handle_circulate_notify;
+    event_handlers[Expose] = handle_expose;
+    event_handlers[PropertyNotify] = handle_property_notify;
+    event_handlers[damage_event + XDamageNotify] = handle_damage_notify;
+    event_handlers[xshape_event + ShapeNotify] = handle_shape_notify;
+    if (has_randr) {
+        event_handlers[randr_event + RRScreenChangeNotify] = handle_screen_change;
+        event_handlers[randr_event + RRNotify] = handle_screen_change;
     }
+    // Present events (-P) come as generic events, which only get here when we paint on this thread
+    event_handlers[GenericEvent] = handle_generic_event;
+}
 
-    if (client->attr.c_class == InputOnly) {
-        format = nullptr;
-    } else {
-        format = XRenderFindVisualFormat(display, client->attr.visual);
-    }
+void handle_event(XEvent *ev) {
+    // Answers that arrived before this event have to be taken in first,
+    // they describe the windows as they were before whatever this event is about
+    if (!pending_clients.empty() || !pending_properties.empty() || !pending_trees.empty())
+        resolve_pending_replies(false);
+
+    if (event_record_file)
+        record_event(ev);
+    Event_Handler handler = event_handlers[ev->type & 0x7f];
+    if (handler)
+        handler(ev);
+}
 
-    Window_Opaqueness opaqueness;
-    if (format && format->type == PictTypeDirect && format->direct.alphaMask) {
-        opaqueness = Window_Opaqueness::ARGB;
-    } else {
-        opaqueness = Window_Opaqueness::SOLID;
+// Interns every atom we need with a single round trip
+void intern_atoms() {
+    char net_wm_cm[32];
+    snprintf(net_wm_cm, sizeof(net_wm_cm), "_NET_WM_CM_S%d", default_screen);
+    char *names[background_prop_count + 5];
+    for (int p = 0; p < background_prop_count; p++)
+        names[p] = (char *) backgroundProps[p];
+    names[background_prop_count] = (char *) "_NET_WM_WINDOW_OPACITY";
+    names[background_prop_count + 1] = (char *) "_NET_WM_NAME";
+    names[background_prop_count + 2] = net_wm_cm;
+    names[background_prop_count + 3] = (char *) "_NET_ACTIVE_WINDOW";
+    names[background_prop_count + 4] = (char *) "_XCOMPMGR_DAMAGE_HZ";
+
+    Atom atoms[background_prop_count + 5];
+    stats.round_trips++;
+    XInternAtoms(display, names, background_prop_count + 5, false, atoms);
+    for (int p = 0; p < background_prop_count; p++)
+        background_atoms[p] = atoms[p];
+    opacity_atom = atoms[background_prop_count];
+    net_wm_name_atom = atoms[background_prop_count + 1];
+    net_wm_cm_atom = atoms[background_prop_count + 2];
+    active_window_atom = atoms[background_prop_count + 3];
+    damage_hz_atom = atoms[background_prop_count + 4];
+}
+
+// Creates the shared memory we publish statistics in (see stats_shm.h)
+void open_stats_shm() {
+    char name[256];
+    stats_shm_name(DisplayString(display), name, sizeof(name));
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        return;
     }
-    client->opaqueness = opaqueness;
-    if (client->extents) {
-        XserverRegion damage;
-        damage = XFixesCreateRegion(display, nullptr, 0);
-        XFixesCopyRegion(display, damage, client->extents);
-        add_damage(damage);
+    // Truncating first throws away whatever an earlier compositor left behind
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(Stats_Shm)) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return;
+    }
+    void *memory = mmap(nullptr, sizeof(Stats_Shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        return;
     }
+    stats_shm = (Stats_Shm *) memory;
+    stats_shm->version = stats_version;
+    stats_shm->ring_size = stats_ring_size;
+    stats_shm->pid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    stats_shm->magic = stats_magic;
 }
 
-void map_win(Window window) {
-    Client *client = get_client_from_window(window);
-
-    if (!client) return;
-
-    client->attr.map_state = IsViewable;
-
-    determine_opaqueness(client);
-    client->damaged = 0;
+// Works out how much every window damaged in the last second and which ones damaged the most
+void update_damage_rates() {
+    static std::vector<Client_Damage_Stats> top;
+    top.clear();
+    for (Client *client = clients.top; client; client = client->below) {
+        client->damage_rate = client->damage_events;
+        client->deferral_rate = client->damage_deferrals;
+        client->damage_events = 0;
+        client->damage_deferrals = 0;
+        if (client->damage_rate == 0)
+            continue;
+        Client_Damage_Stats entry;
+        entry.window = client->window;
+        entry.damage_events = client->damage_rate;
+        entry.deferrals = client->deferral_rate;
+        top.push_back(entry);
+    }
+    worst_offender_count = std::min((int) top.size(), stats_top_clients);
+    std::partial_sort(top.begin(), top.begin() + worst_offender_count, top.end(),
+                      [](const Client_Damage_Stats &a, const Client_Damage_Stats &b) {
+                          return a.damage_events > b.damage_events;
+                      });
+    std::copy(top.begin(), top.begin() + worst_offender_count, worst_offenders);
 }
 
-void add_client(Window window) {
-    Client *client = new Client;
+void publish_frame(uint64_t now, uint64_t paint_us, const Model_Stats &model) {
+    const Statistics &previous = previous_frame_stats;
+    Frame_Stats frame = {};
+    frame.timestamp_us = now;
+    frame.paint_us = paint_us;
+    frame.events = stats.events - previous.events;
+    frame.damage_events = stats.damage_events - previous.damage_events;
+    frame.damage_subtracts = stats.damage_subtracts - previous.damage_subtracts;
+    frame.damage_collapses = stats.damage_collapses - previous.damage_collapses;
+    frame.regions_computed = stats.regions_computed - previous.regions_computed;
+    frame.server_regions_created = stats.server_regions_created - previous.server_regions_created;
+    frame.composites = stats.composites - previous.composites;
+    frame.composited_pixels = stats.composited_pixels - previous.composited_pixels;
+    frame.requests = stats.requests - previous.requests;
+    frame.round_trips = stats.round_trips - previous.round_trips;
+    frame.live_pixmaps = live_pixmaps;
+    frame.live_pictures = live_pictures;
+    frame.live_clients = model.live_clients;
+    stats_write_frame(stats_shm, frame);
+}
 
-    client->window = window;
-    if (!XGetWindowAttributes(display, window, &client->attr)) {
-        delete (client);
-        return;
+// The damage counts are per second, so they only get worked out and published that often
+void update_damage_rates_every_second(uint64_t now) {
+    static uint64_t last_update = 0;
+    if (now - last_update >= 1000000) {
+        update_damage_rates();
+        if (stats_shm)
+            stats_write_top_clients(stats_shm, worst_offenders, worst_offender_count);
+        last_update = now;
     }
-    client->shaped = false;
-    client->shape_bounds.x = client->attr.x;
-    client->shape_bounds.y = client->attr.y;
-    client->shape_bounds.width = client->attr.width;
-    client->shape_bounds.height = client->attr.height;
-    client->damaged = 0;
+}
 
-    client->pixmap = 0;
-    client->picture = 0;
-    if (client->attr.c_class == InputOnly) {
-        client->damage = 0;
-    } else {
-        client->damage = XDamageCreate(display, window, XDamageReportNonEmpty);
-        XShapeSelectInput(display, window, ShapeNotifyMask);
+// A frame comes in two halves.
+// prepare_frame works on the window model: it gets in everything we asked the server about the windows
+// and works out all_damage. It returns false when there's nothing to paint.
+// render_frame paints the damage and sends it off.
+// Without -p paint_frame runs both back to back, with -p the event thread does the first half
+// and the paint thread the second (see publish_snapshot).
+//
+bool prepare_frame() {
+    // Whatever we asked about windows has to be in before we can draw them
+    resolve_pending_replies(true);
+    acknowledge_damage();
+    if (monitors_changed)
+        update_monitors();
+    // The window covering the screen draws itself, anything we painted would only go over it
+    if (unredirected_window) {
+        all_damage.clear();
+        return false;
     }
-    client->alpha_pict = 0;
-    client->border_size = 0;
-    client->extents = 0;
 
-    client->border_clip = 0;
+    simplify_damage();
+    // Nobody can see what falls between the monitors
+    long damaged_pixels = all_damage.area();
+    all_damage.intersect(monitor_area);
+    stats.dead_space_pixels += damaged_pixels - all_damage.area();
+    return !all_damage.empty();
+}
 
-    clients.insert(clients.begin(), client);
+void render_frame(const Banded_Region &damage, Paint_List &list, const Model_Stats &model) {
+    uint64_t trace = trace_start();
+    uint64_t paint_start = monotonic_us();
+    paint_all(damage, list);
+    uint64_t paint_end = monotonic_us();
+    // Instead of waiting on the server (XSync) we just send off everything we queued up this frame
+    uint64_t trace_flush = trace_start();
+    XFlush(display);
+    trace_end("flush", trace_flush);
+
+    unsigned long next_request = NextRequest(display);
+    unsigned long requests = next_request - frame_first_request;
+    frame_first_request = next_request;
+    stats.frames++;
+    stats.requests += requests;
+    if (synchronous)
+        stats.round_trips += requests;
+    prune_window_requests();
+    if (stats_shm)
+        publish_frame(paint_end, paint_end - paint_start, model);
+    if (print_stats)
+        print_statistics(model);
+    previous_frame_stats = stats;
+    trace_end("frame", trace, "requests", requests);
+}
 
-    if (client->attr.map_state == IsViewable)
-        map_win(window);
+// paint_list, built again first if the stacking order changed since
+Paint_List &current_paint_list() {
+    if (paint_list.generation != clients.generation)
+        paint_list.build(clients);
+    return paint_list;
 }
 
-void restack_win(Window moving_window, Window target_window) {
-    //  The moving_window wants to be placed in front of the target_window and we shall do just that
-    //
-    Client *moving_client = nullptr;
-    for (int i = 0; i < clients.size(); ++i) {
-        moving_client = clients[i];
-        if (moving_client->window == moving_window) {
-            clients.erase(clients.begin() + i);
-            break;
-        }
-    }
-    if (moving_client != nullptr) {
-        if (target_window != 0) {
-            for (int i = 0; i < clients.size(); ++i) {
-                if (clients[i]->window == target_window) {
-                    clients.insert(clients.begin() + i, moving_client);
-                    return;
-                }
-            }
-        } else { // The moving client wants to go to the bottom of the list
-            clients.push_back(moving_client);
-        }
-    }
+// Paints everything that was damaged since the last frame
+void paint_frame() {
+    if (!prepare_frame())
+        return;
+    render_frame(all_damage, current_paint_list(), current_model_stats());
+    all_damage.clear();
 }
 
-void configure_client(XConfigureEvent *ce) {
-    Client *client = get_client_from_window(ce->window);
+// Set by SIGINT and SIGTERM, so that we get to write out the trace and the event record before exiting
+// (and remove the thumbnail socket).
+// The paint thread (-p) reads it too, which takes an atomic, volatile only covers the signal handler.
+// A lock free atomic is also safe to set from a signal handler.
+std::atomic<bool> quit(false);
 
-    if (client == nullptr) {
-        if (ce->window == root_window) {
-            if (root_buffer != 0) {
-                XRenderFreePicture(display, root_buffer);
-                root_buffer = 0;
-            }
-            root_width = ce->width;
-            root_height = ce->height;
-        }
-        return;
-    }
+void handle_quit_signal(int) {
+    quit = true;
+}
 
-    XserverRegion damage = XFixesCreateRegion(display, nullptr, 0);
-    if (client->extents != 0)
-        XFixesCopyRegion(display, damage, client->extents);
+// The signal mask run_event_loop waits with.
+// Once we handle SIGINT and SIGTERM they're blocked everywhere else, so they can only come in during ppoll.
+// Otherwise one arriving after we looked at quit, but before we went to sleep, would only be seen on the next event.
+sigset_t wait_signal_mask;
 
-    client->shape_bounds.x -= client->attr.x;
-    client->shape_bounds.y -= client->attr.y;
-    client->attr.x = ce->x;
-    client->attr.y = ce->y;
-    if (client->attr.width != ce->width || client->attr.height != ce->height) {
-        if (client->pixmap) {
-            XFreePixmap(display, client->pixmap);
-            client->pixmap = 0;
-            if (client->picture) {
-                XRenderFreePicture(display, client->picture);
-                client->picture = 0;
-            }
-        }
+// Threaded painting (-p)
+// A long paint (big ARGB windows, a slow Render) holds up reading the events that came in meanwhile,
+// so with -p the painting moves to a thread of its own with its own connection to the server,
+// and the event thread (the main thread) only keeps the window model up to date.
+//
+// Whenever there's damage, the event thread copies what painting needs into a Frame_Snapshot
+// (the windows that are shown, in stacking order, with their regions, and the damage) and hands it over
+// through latest_snapshot. The paint thread always takes the newest one. If it didn't get to the previous one,
+// the new one takes over its damage, so nothing is lost, it just gets painted with the newer windows.
+// Handing over is a single atomic exchange, so neither thread ever waits on the other.
+//
+// Window pixmaps and pictures belong to the paint thread (see Painted_Window),
+// the snapshot only says when one has to be named again (Client::pixmap_generation).
+//
+// The damage objects are subtracted by the paint thread as well, right before it paints.
+// The server doesn't keep the requests of two connections in order, so a subtract sent by the event thread
+// could be done after the paint that was meant to come after it, and whatever the window drew in between
+// would be acknowledged without ever being painted. Damage ids are the same on every connection.
+//
+struct Frame_Snapshot {
+    std::vector<Client> windows; // top to bottom
+    Banded_Region damage;
+    std::vector<Damage_Subtract> damage_subtracts; // for the damage in this snapshot
+
+    int root_width, root_height;
+    std::vector<Region_Box> monitors;
+    bool background_changed;
+    Statistics stats; // what the event thread did since the previous snapshot
+    Model_Stats model;
+};
+std::atomic<Frame_Snapshot *> latest_snapshot(nullptr);
+std::atomic<Frame_Snapshot *> spare_snapshot(nullptr); // a used snapshot, so that a new one doesn't have to be allocated
+int paint_wakeup_fd = -1; // an eventfd, written to whenever a snapshot is handed over
+
+// Either thread can call this with a snapshot it's done with
+void recycle_snapshot(Frame_Snapshot *snapshot) {
+    delete spare_snapshot.exchange(snapshot);
+}
+
+// Runs on the event thread
+void publish_snapshot() {
+    // Without a frame to come after them the subtracts can't get ahead of one
+    if (!prepare_frame()) {
+        send_damage_subtracts(damage_subtracts);
+        return;
     }
-    client->attr.width = ce->width;
-    client->attr.height = ce->height;
-    client->attr.border_width = ce->border_width;
-    client->attr.override_redirect = ce->override_redirect;
 
-    restack_win(ce->window, ce->above);
+    uint64_t trace = trace_start();
+    Frame_Snapshot *snapshot = spare_snapshot.exchange(nullptr);
+    if (!snapshot)
+        snapshot = new Frame_Snapshot;
 
-    if (damage) {
-        XserverRegion extents = client_extents(client);
-        XFixesUnionRegion(display, damage, damage, extents);
-        XFixesDestroyRegion(display, extents);
-        add_damage(damage);
+    // Copying over the windows of a recycled snapshot reuses the memory their regions already have
+    size_t count = 0;
+    Paint_List &list = current_paint_list();
+    for (size_t i = 0; i < list.size(); i++) {
+        if (!list.damaged[i])
+            continue;
+        Client *w = list.clients[i];
+        // The paint thread can't ask about shapes, so it gets the regions ready made
+        if (!w->border_size_valid) {
+            w->border_size = get_border_size(w);
+            w->border_size_valid = true;
+            stats.regions_computed++;
+        }
+        if (w->extents.empty()) {
+            w->extents = client_extents(w);
+            stats.regions_computed++;
+        }
+        if (count < snapshot->windows.size())
+            snapshot->windows[count] = *w;
+        else
+            snapshot->windows.push_back(*w);
+        count++;
     }
-    client->shape_bounds.x += client->attr.x;
-    client->shape_bounds.y += client->attr.y;
-    if (!client->shaped) {
-        client->shape_bounds.width = client->attr.width;
-        client->shape_bounds.height = client->attr.height;
+    snapshot->windows.resize(count);
+    snapshot->damage = all_damage;
+    all_damage.clear();
+    snapshot->damage_subtracts.swap(damage_subtracts);
+    damage_subtracts.clear();
+    snapshot->root_width = root_width;
+    snapshot->root_height = root_height;
+    snapshot->monitors = monitors;
+    snapshot->background_changed = background_changed;
+    background_changed = false;
+
+    unsigned long next_request = NextRequest(display);
+    stats.requests += next_request - frame_first_request;
+    if (synchronous)
+        stats.round_trips += next_request - frame_first_request;
+    frame_first_request = next_request;
+    prune_window_requests();
+    snapshot->stats = stats;
+    stats = Statistics();
+    snapshot->model = current_model_stats();
+
+    Frame_Snapshot *unpainted = latest_snapshot.exchange(nullptr, std::memory_order_acquire);
+    if (unpainted) {
+        snapshot->damage.unite(unpainted->damage);
+        snapshot->damage_subtracts.insert(snapshot->damage_subtracts.end(), unpainted->damage_subtracts.begin(),
+                                          unpainted->damage_subtracts.end());
+        snapshot->background_changed = snapshot->background_changed || unpainted->background_changed;
+        add_statistics(snapshot->stats, unpainted->stats);
+        recycle_snapshot(unpainted);
     }
+    latest_snapshot.store(snapshot, std::memory_order_release);
 
-    clip_changed = true;
+    uint64_t one = 1;
+    if (write(paint_wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write eventfd");
+    trace_end("snapshot", trace, "windows", count);
 }
 
-void circulate_client(XCirculateEvent *ce) {
-    Client *client = get_client_from_window(ce->window);
-
-    if (!client) return;
+// A window pixmap the paint thread named, and the picture for it
+struct Painted_Window {
+    Pixmap pixmap;
+    Picture picture;
+    unsigned int pixmap_generation;
+    uint64_t frame; // the last frame the window was in
+};
 
-    Window target_window;
-    if (ce->place == PlaceOnTop)
-        target_window = clients[0]->window;
-    else if (ce->place == PlaceOnBottom)
-        target_window = 0;
+// Runs on the paint thread
+void paint_snapshot(Frame_Snapshot *snapshot, std::unordered_map<Window, Painted_Window> &painted, uint64_t frame) {
+    static Paint_List list;
+    if (snapshot->root_width != root_width || snapshot->root_height != root_height) {
+        free_back_buffers();
+        root_width = snapshot->root_width;
+        root_height = snapshot->root_height;
+    }
+    monitors = snapshot->monitors;
+    if (snapshot->background_changed) {
+        free_picture(root_tile);
+        wallpaper.clear();
+    }
+    add_statistics(stats, snapshot->stats);
+
+    // Put the copies in a paint list and give them back the pixmaps we named for them
+    std::vector<Client> &windows = snapshot->windows;
+    list.clear();
+    for (Client &w : windows) {
+        list.push_bottom(&w);
+        w.pixmap = 0;
+        w.picture = 0;
+        auto found = painted.find(w.window);
+        if (found == painted.end())
+            continue;
+        if (found->second.pixmap_generation == w.pixmap_generation) {
+            w.pixmap = found->second.pixmap;
+            w.picture = found->second.picture;
+        } else {
+            free_picture(found->second.picture);
+            free_pixmap(found->second.pixmap);
+            painted.erase(found);
+        }
+    }
 
-    restack_win(client->window, target_window);
-    clip_changed = true;
+    // (a window destroyed meanwhile fails its subtract, which only makes us forget its pixmap a frame early)
+    send_damage_subtracts(snapshot->damage_subtracts);
+    render_frame(snapshot->damage, list, snapshot->model);
+
+    for (const Client &w : windows)
+        painted[w.window] = {w.pixmap, w.picture, w.pixmap_generation, frame};
+    // A request about a window failing means it's gone, or its pixmap is, so we forget about it
+    for (Window window : failed_windows) {
+        auto found = painted.find(window);
+        if (found != painted.end())
+            found->second.frame = 0;
+    }
+    failed_windows.clear();
+    for (auto it = painted.begin(); it != painted.end();) {
+        if (it->second.frame != frame) {
+            free_picture(it->second.picture);
+            free_pixmap(it->second.pixmap);
+            it = painted.erase(it);
+        } else {
+            ++it;
+        }
+    }
 }
 
-void destroy_win(Window window, bool gone) {
-    int i = 0;
-    for (Client *w: clients) {
-        if (w->window == window) {
-            if (gone)
-                finish_unmap_client(w);
-            if (w->picture) {
-                XRenderFreePicture(display, w->picture);
-                w->picture = 0;
-            }
-            if (w->alpha_pict) {
-                XRenderFreePicture(display, w->alpha_pict);
-                w->alpha_pict = 0;
-            }
-            if (w->damage != 0) {
-                XDamageDestroy(display, w->damage);
-                w->damage = 0;
-            }
-            break;
-        }
-        i++;
+// Paints the newest snapshot, at most once every frame_interval_us
+void paint_thread_main(int width, int height) {
+    display = XOpenDisplay(nullptr);
+    if (!display) {
+        fprintf(stderr, "The paint thread can't open the display\n");
+        exit(1);
     }
-    if (i < clients.size()) {
-        clients.erase(clients.begin() + i);
+    if (synchronous)
+        XSynchronize(display, 1);
+    root_width = width;
+    root_height = height;
+    if (present_enabled)
+        present_select_input();
+    frame_first_request = NextRequest(display);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        exit(1);
     }
-}
 
-void damage_client(XDamageNotifyEvent *de) {
-    Client *client = get_client_from_window(de->drawable);
+    std::unordered_map<Window, Painted_Window> painted;
+    uint64_t next_frame = 0;
+    uint64_t frame = 0;
+    while (!quit) {
+        pollfd fds[3];
+        fds[0].fd = paint_wakeup_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = timer_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        fds[2].fd = ConnectionNumber(display);
+        fds[2].events = POLLIN;
+        fds[2].revents = 0;
+        // Signals are blocked on this thread, the event thread sets quit and then wakes us through paint_wakeup_fd
+        if (poll(fds, 3, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        uint64_t value;
+        if ((fds[0].revents & POLLIN) && read(paint_wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            perror("read eventfd");
+        if ((fds[1].revents & POLLIN) && read(timer_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            perror("read timerfd");
+        // The only events on this connection are the Present ones (-P), reading them also gets the errors
+        // to the error_handler
+        while (XPending(display)) {
+            XEvent ev;
+            XNextEvent(display, &ev);
+            handle_present_event(&ev);
+        }
+        if (!latest_snapshot.load(std::memory_order_relaxed))
+            continue;
 
-    if (!client) return;
+        uint64_t now = monotonic_us();
+        // With -P the server paces us, otherwise the -r timer does
+        uint64_t wait_until = 0;
+        if (present_enabled && !present_ready(now))
+            wait_until = present_deadline();
+        else if (!present_enabled && !immediate_mode && now < next_frame)
+            wait_until = next_frame;
+        if (wait_until) {
+            itimerspec timer = {};
+            timer.it_value.tv_sec = wait_until / 1000000;
+            timer.it_value.tv_nsec = (wait_until % 1000000) * 1000;
+            timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr);
+            continue;
+        }
+        Frame_Snapshot *snapshot = latest_snapshot.exchange(nullptr, std::memory_order_acquire);
+        if (!snapshot)
+            continue;
+        paint_snapshot(snapshot, painted, ++frame);
+        recycle_snapshot(snapshot);
 
-    XserverRegion parts;
-    if (!client->damaged) {
-        parts = client_extents(client);
-        XDamageSubtract(display, client->damage, 0, 0);
-    } else {
-        parts = XFixesCreateRegion(display, nullptr, 0);
-        XDamageSubtract(display, client->damage, 0, parts);
-        XFixesTranslateRegion(display, parts,
-                              client->attr.x + client->attr.border_width,
-                              client->attr.y + client->attr.border_width);
+        next_frame += frame_interval_us;
+        if (next_frame <= now)
+            next_frame = now + frame_interval_us;
     }
-    add_damage(parts);
-    client->damaged = 1;
 }
 
-void shape_win(XShapeEvent *se) {
-    Client *client = get_client_from_window(se->window);
-
-    if (!client) return;
-
-    if (se->kind == ShapeClip || se->kind == ShapeBounding) {
-        XserverRegion region0;
-        XserverRegion region1;
-        clip_changed = true;
+// If we painted every time we ran out of events, a client that damages itself in bursts
+// could make us paint many times for every time the monitor actually refreshes.
+// So instead damage is collected into all_damage, and painted at most once every frame_interval_us.
+// While there's nothing to do we sleep in poll on both the X connection and a timerfd,
+// which wakes us up when the next frame is due.
+//
+void run_event_loop() {
+    int x_fd = ConnectionNumber(display);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        exit(1);
+    }
 
-        region0 = XFixesCreateRegion(display, &client->shape_bounds, 1);
+    uint64_t next_frame = 0; // the earliest time we're allowed to paint again
+    int events_since_frame = 0;
+    int skipped_frames = 0;
+    frame_first_request = NextRequest(display);
 
-        if (se->shaped) {
-            client->shaped = true;
-            client->shape_bounds.x = client->attr.x + se->x;
-            client->shape_bounds.y = client->attr.y + se->y;
-            client->shape_bounds.width = se->width;
-            client->shape_bounds.height = se->height;
-        } else {
-            client->shaped = false;
-            client->shape_bounds.x = client->attr.x;
-            client->shape_bounds.y = client->attr.y;
-            client->shape_bounds.width = client->attr.width;
-            client->shape_bounds.height = client->attr.height;
+    XEvent ev;
+    while (!quit) {
+        uint64_t trace = trace_start();
+        int events = 0;
+        while (XPending(display)) { // XPending returns the amount of events left to process
+            XNextEvent(display, &ev);
+            handle_event(&ev);
+            events++;
+            stats.events++;
+            if (stats_shm)
+                stats_increment(stats_shm->events_by_type[ev.type & 0x7f]);
+        }
+        resolve_pending_replies(false);
+        send_thumbnail_replies();
+        events_since_frame += events;
+        if (events)
+            trace_end("event drain", trace, "events", events);
+
+        handle_failed_requests();
+        uint64_t now = monotonic_us();
+        update_unredirection(now);
+        update_damage_rates_every_second(now);
+
+        bool waiting_for_frame = false;
+        bool waiting_for_present = false;
+        if (paint_thread_enabled) {
+            // The paint thread does the pacing, we just keep it up to date
+            if (!all_damage.empty() || damage_pending(now))
+                publish_snapshot();
+        } else if ((!all_damage.empty() || damage_pending(now)) && present_enabled && !present_ready(now)) {
+            // The last frame isn't on the screen yet, its PresentCompleteNotify wakes us up
+            waiting_for_present = true;
+        } else if (!all_damage.empty() || damage_pending(now)) {
+            if (immediate_mode || present_enabled || now >= next_frame) {
+                // When events are flooding in, whatever we'd paint now is already out of date,
+                // so we put the frame off to catch up first.
+                // But only a couple of times in a row, so that the latency stays bounded.
+                if (!immediate_mode && events_since_frame > backlog_limit && skipped_frames < max_skipped_frames) {
+                    skipped_frames++;
+                    stats.skipped_frames++;
+                    next_frame = now + frame_interval_us;
+                    waiting_for_frame = true;
+                } else {
+                    paint_frame();
+                    skipped_frames = 0;
+                    // Stay on the same frame grid, unless we've fallen more than a whole frame behind it
+                    next_frame += frame_interval_us;
+                    if (next_frame <= now)
+                        next_frame = now + frame_interval_us;
+                }
+                events_since_frame = 0;
+            } else {
+                waiting_for_frame = true;
+            }
         }
 
-        region1 = XFixesCreateRegion(display, &client->shape_bounds, 1);
-        XFixesUnionRegion(display, region0, region0, region1);
-        XFixesDestroyRegion(display, region1);
+        // We also have to wake up to unredirect a fullscreen window that has stopped sending damage,
+        // and to paint damage we held back once it's due
+        uint64_t wake_up = waiting_for_frame ? next_frame : 0;
+        uint64_t unredirection_check = next_unredirection_check();
+        if (unredirection_check && (!wake_up || unredirection_check < wake_up))
+            wake_up = unredirection_check;
+        if (!held_back_clients.empty() && (!wake_up || next_deferred_damage_us < wake_up))
+            wake_up = std::max(next_deferred_damage_us, next_frame);
+        if (waiting_for_present && (!wake_up || present_deadline() < wake_up))
+            wake_up = present_deadline();
+        if (wake_up) {
+            itimerspec timer = {};
+            timer.it_value.tv_sec = wake_up / 1000000;
+            timer.it_value.tv_nsec = (wake_up % 1000000) * 1000;
+            timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr);
+        }
 
-        /* ask for repaint of the old and new region */
-        paint_all(region0);
+        XFlush(display);
+        xcb_flush(xcb_connection);
+        // The X connection, the timer when we need it, and the thumbnail socket and its connections with -L
+        static std::vector<pollfd> fds;
+        fds.assign(2, pollfd());
+        fds[0].fd = x_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake_up ? timer_fd : -1;
+        fds[1].events = POLLIN;
+        if (thumbnail_listen_fd >= 0) {
+            fds.push_back({thumbnail_listen_fd, POLLIN, 0});
+            for (int connection : thumbnail_connections)
+                fds.push_back({connection, POLLIN, 0});
+        }
+        if (ppoll(fds.data(), fds.size(), nullptr, &wait_signal_mask) < 0 && errno != EINTR) {
+            perror("ppoll");
+            exit(1);
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                perror("read timerfd");
+        }
+        for (size_t i = 3; i < fds.size(); i++) {
+            if (fds[i].revents && !read_thumbnail_requests(fds[i].fd))
+                close_thumbnail_connection(fds[i].fd);
+        }
+        if (fds.size() > 2 && (fds[2].revents & POLLIN))
+            accept_thumbnail_connections();
     }
 }
 
-int error_handler(Display *dpy, XErrorEvent *ev) {
-    // You should do something here but we do nothing when an error happens
-    //
-    // abort();
-    return 0;
-}
-
-void expose_root(std::vector<XRectangle *> rectangles) {
-    // Important:
-    // the first element of a std::vector can be passed to a c function expecting a c list
-    // which would look like XRectangle *list (which is in fact what is done in the original xcompmgr)
-    // but we don't want to manually malloc and stuff so we use vectors
-    XserverRegion region = XFixesCreateRegion(display, rectangles[0], rectangles.size());
-
-    add_damage(region);
-}
-
 // If you are making a windows manager with a compositor and not _just_ a compositor, then this isn't that relevant
 //
 bool register_as_the_composite_manager() {
-    Window w;
-    Atom a;
-    char net_wm_cm[] = "_NET_WM_CM_Sxx";
-
-    snprintf(net_wm_cm, sizeof(net_wm_cm), "_NET_WM_CM_S%d", default_screen);
-    a = XInternAtom(display, net_wm_cm, false);
-
-    w = XGetSelectionOwner(display, a);
+    Window w = XGetSelectionOwner(display, net_wm_cm_atom);
     if (w != 0) {
         XTextProperty tp;
         char **strs;
         int count;
-        Atom winNameAtom = XInternAtom(display, "_NET_WM_NAME", false);
-
-        if (!XGetTextProperty(display, w, &tp, winNameAtom) &&
+        if (!XGetTextProperty(display, w, &tp, net_wm_name_atom) &&
             !XGetTextProperty(display, w, &tp, XA_WM_NAME)) {
             fprintf(stderr,
                     "Another composite manager is already running (0x%lx)\n",
@@ -681,12 +3083,155 @@ bool register_as_the_composite_manager() {
 
     w = XCreateSimpleWindow(display, RootWindow (display, default_screen), 0, 0, 1, 1, 0, 0, 0);
     Xutf8SetWMProperties(display, w, "xcompmgr", "xcompmgr", nullptr, 0, nullptr, nullptr, nullptr);
-    XSetSelectionOwner(display, a, w, 0);
+    XSetSelectionOwner(display, net_wm_cm_atom, w, 0);
 
     return true;
 }
 
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [options]\n", program);
+    fprintf(stderr, "  -s  print statistics once a second\n");
+    fprintf(stderr, "  -N  don't publish statistics in shared memory for xcompmgr-simple-stats\n");
+    fprintf(stderr, "  -S  synchronous mode, wait for the server after every request (for debugging)\n");
+    fprintf(stderr, "  -r  refresh rate in hz, we paint at most this many times a second (default 60)\n");
+    fprintf(stderr, "  -i  immediate mode, paint as soon as all events are processed\n");
+    fprintf(stderr, "  -b  number of back buffers to take turns drawing into, 1 to %d (default 1, 2 with -P)\n", max_back_buffers);
+    fprintf(stderr, "  -B  rendering backend: xrender, or cpu to composite on our side over MIT-SHM (default xrender)\n");
+    fprintf(stderr, "  -P  present frames with the Present extension in the composite overlay window, paced by the server\n");
+    fprintf(stderr, "  -p  paint on a separate thread with its own connection, so painting never holds up events\n");
+    fprintf(stderr, "  -U  never unredirect fullscreen windows, always composite them\n");
+    fprintf(stderr, "  -m  cover the damage with fewer, bigger boxes when it has more rectangles than this, 0 never does (default 16)\n");
+    fprintf(stderr, "  -c  what one damage rectangle costs, in pixels painted (default 2000, see bench-damage-crossover)\n");
+    fprintf(stderr, "  -D  paint the damage of a window at most this many times a second, unless it's the active window\n"
+                    "      or sets its own limit in _XCOMPMGR_DAMAGE_HZ (default 0, no limit)\n");
+    fprintf(stderr, "  -t  record a timeline of every frame and write it to this file on exit (Chrome trace format)\n");
+    fprintf(stderr, "  -E  record every event that changes the screen to this file, for xcompmgr-simple-replay\n");
+    fprintf(stderr, "  -L  hand out window thumbnails to other programs over a unix socket at this path (see thumbnail.h)\n");
+    fprintf(stderr, "  -T  how many spans the timeline keeps, the oldest are dropped (default %d)\n", default_trace_spans);
+}
+
 int main(int argc, char **argv) {
+    uint64_t startup_start = monotonic_us();
+    bool publish_stats = true;
+    const char *trace_path = nullptr;
+    const char *event_record_path = nullptr;
+    bool back_buffers_given = false;
+    int trace_spans = default_trace_spans;
+    int option;
+    while ((option = getopt(argc, argv, "sNSr:ib:B:pPUD:m:c:t:T:E:L:h")) != -1) {
+        switch (option) {
+            case 'B':
+                if (strcmp(optarg, "cpu") == 0) {
+                    backend = CPU_BACKEND;
+                } else if (strcmp(optarg, "xrender") != 0) {
+                    fprintf(stderr, "Unknown backend %s, it's either xrender or cpu\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                paint_thread_enabled = true;
+                break;
+            case 'P':
+                present_requested = true;
+                break;
+            case 'U':
+                unredirect_enabled = false;
+                break;
+            case 'm':
+                max_damage_boxes = atoi(optarg);
+                if (max_damage_boxes < 0) {
+                    fprintf(stderr, "The number of damage rectangles can't be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                damage_box_cost = atol(optarg);
+                if (damage_box_cost < 0) {
+                    fprintf(stderr, "The cost of a damage rectangle can't be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'D': {
+                int hz = atoi(optarg);
+                if (hz < 0) {
+                    fprintf(stderr, "The damage rate limit can't be negative\n");
+                    exit(1);
+                }
+                default_max_damage_hz = hz;
+                break;
+            }
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'E':
+                event_record_path = optarg;
+                break;
+            case 'L':
+                thumbnail_socket_path = optarg;
+                break;
+            case 'T':
+                trace_spans = atoi(optarg);
+                if (trace_spans <= 0) {
+                    fprintf(stderr, "The number of trace spans has to be a positive number\n");
+                    exit(1);
+                }
+                break;
+            case 'r': {
+                int hz = atoi(optarg);
+                if (hz <= 0) {
+                    fprintf(stderr, "Refresh rate has to be a positive number\n");
+                    exit(1);
+                }
+                frame_interval_us = 1000000 / hz;
+                break;
+            }
+            case 'i':
+                immediate_mode = true;
+                break;
+            case 'b':
+                back_buffers_given = true;
+                back_buffer_count = atoi(optarg);
+                if (back_buffer_count < 1 || back_buffer_count > max_back_buffers) {
+                    fprintf(stderr, "The number of back buffers has to be between 1 and %d\n", max_back_buffers);
+                    exit(1);
+                }
+                break;
+            case 's':
+                print_stats = true;
+                break;
+            case 'N':
+                publish_stats = false;
+                break;
+            case 'S':
+                synchronous = true;
+                break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? 0 : 1);
+        }
+    }
+
+    if (trace_path)
+        trace_open(trace_path, trace_spans);
+    // Both get written out when we exit, and the thumbnail socket taken away
+    pthread_sigmask(SIG_SETMASK, nullptr, &wait_signal_mask);
+    if (trace_path || event_record_path || thumbnail_socket_path) {
+        struct sigaction action = {};
+        action.sa_handler = handle_quit_signal;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        sigdelset(&wait_signal_mask, SIGINT);
+        sigdelset(&wait_signal_mask, SIGTERM);
+    }
+
+    // Xlib has some state shared between connections, which has to be locked when two threads use it
+    if (paint_thread_enabled)
+        XInitThreads();
     display = XOpenDisplay(nullptr);
     if (!display) {
         fprintf(stderr, "Can't open target_display\n");
@@ -694,7 +3239,11 @@ int main(int argc, char **argv) {
     }
 
     XSetErrorHandler(error_handler);
-    XSynchronize(display, 1); // This is supposed to synchronize "behaviour" but I don't know what that means
+    // Normally Xlib queues up requests and sends them in one go when we flush at the end of a frame.
+    // Synchronous mode sends every request and waits for the answer, which is slow, but an error then
+    // arrives right after the call that caused it, so it's handy when debugging.
+    if (synchronous)
+        XSynchronize(display, 1);
 
     default_screen = XDefaultScreen(display);
     root_window = XRootWindow(display, default_screen);
@@ -729,23 +3278,52 @@ int main(int argc, char **argv) {
         fprintf(stderr, "No XShape extension\n");
         exit(1);
     }
+    if (backend == CPU_BACKEND) {
+        if (!XShmQueryExtension(display)) {
+            fprintf(stderr, "The CPU backend needs the MIT-SHM extension\n");
+            exit(1);
+        }
+        blend_over = best_blend_over();
+        framebuffer_gc = XCreateGC(display, root_window, 0, nullptr);
+        // Child windows would clip what we draw on the root otherwise, even though they're redirected
+        XSetSubwindowMode(display, framebuffer_gc, IncludeInferiors);
+        // Shared memory only works when the server runs on the same machine, which we only find out from an error
+        unsigned long errors = stats.errors;
+        cpu_create_framebuffer();
+        XSync(display, false);
+        if (stats.errors != errors) {
+            fprintf(stderr, "The server can't attach our shared memory, is it running on another machine?\n");
+            exit(1);
+        }
+    }
+    // RandR is optional, without it the whole root is treated as one monitor
+    has_randr = XRRQueryExtension(display, &randr_event, &randr_error);
+
+    intern_atoms();
+    init_event_handlers();
+    xcb_connection = XGetXCBConnection(display);
 
     if (!register_as_the_composite_manager()) {
         exit(1);
     }
 
-    // Initialize some atoms
-    opacity_atom = XInternAtom(display, "_NET_WM_WINDOW_OPACITY", false);
+    if (publish_stats)
+        open_stats_shm();
 
     // Setup the root_picture which is the thing we draw on to display to the screen
     XRenderPictureAttributes pa;
     pa.subwindow_mode = IncludeInferiors;
-    root_picture = XRenderCreatePicture(display, root_window,
-                                        XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
-                                        CPSubwindowMode,
-                                        &pa);
-    all_damage = 0;
-    clip_changed = true;
+    root_picture = create_picture(root_window,
+                                  find_visual_format(XDefaultVisual(display, default_screen)),
+                                  CPSubwindowMode,
+                                  &pa);
+    if (present_requested)
+        present_enabled = init_present();
+    if (present_enabled && !paint_thread_enabled)
+        present_select_input();
+    // One on the screen and one to draw the next frame into
+    if (present_enabled && !back_buffers_given)
+        back_buffer_count = 2;
 
     // This tells X that we don't want the windows to be displayed automatically and that we are going to composite it ourselves
     XCompositeRedirectSubwindows(display, root_window, CompositeRedirectManual);
@@ -754,105 +3332,59 @@ int main(int argc, char **argv) {
                  SubstructureNotifyMask | ExposureMask | StructureNotifyMask | PropertyChangeMask);
     // We also want to be notified when the shape (bounds usually) of the root window changes
     XShapeSelectInput(display, root_window, ShapeNotifyMask);
+    // and when monitors come, go, or change
+    if (has_randr)
+        XRRSelectInput(display, root_window, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    update_monitors();
 
     // Here is where we get all the windows that already exist on the server
     // and add them to our clients list so that we can composite them
-    XGrabServer(display);
-    Window *children;
-    unsigned int children_count;
-    Window root_return, parent_return;
-    XQueryTree(display, root_window, &root_return, &parent_return, &children, &children_count);
-    for (int i = 0; i < children_count; i++)
-        add_client(children[i]);
-    XFree(children);
-    XUngrabServer(display);
-
-    std::vector<XRectangle *> root_expose_rects;
-
-    paint_all(0);
-
-    XEvent ev;
-    while (true) {
-        do {
-            XNextEvent(display, &ev);
-            switch (ev.type) {
-                case CreateNotify:
-                    add_client(ev.xcreatewindow.window);
-                    break;
-                case ConfigureNotify:
-                    configure_client(&ev.xconfigure);
-                    break;
-                case DestroyNotify:
-                    destroy_win(ev.xdestroywindow.window, true);
-                    break;
-                case MapNotify:
-                    map_win(ev.xmap.window);
-                    break;
-                case UnmapNotify:
-                    unmap_win(ev.xunmap.window);
-                    break;
-                case ReparentNotify:
-                    if (ev.xreparent.parent == root_window)
-                        add_client(ev.xreparent.window);
-                    else
-                        destroy_win(ev.xreparent.window, false);
-                    break;
-                case CirculateNotify:
-                    circulate_client(&ev.xcirculate);
-                    break;
-                case Expose:
-                    if (ev.xexpose.window == root_window) {
-                        XRectangle *rect = new XRectangle;
-                        rect->x = ev.xexpose.x;
-                        rect->y = ev.xexpose.y;
-                        rect->width = ev.xexpose.width;
-                        rect->height = ev.xexpose.height;
-                        root_expose_rects.push_back(rect);
-
-                        // The count equals the number of expose events left to come so we wait until there are
-                        // zero left to redraw optimally
-                        //
-                        if (ev.xexpose.count == 0) {
-                            expose_root(root_expose_rects);
-                            root_expose_rects.clear();
-                        }
-                    }
-                    break;
-                case PropertyNotify:
-                    for (int p = 0; backgroundProps[p]; p++) {
-                        if (ev.xproperty.atom == XInternAtom(display, backgroundProps[p], false)) {
-                            if (root_tile) {
-                                XClearArea(display, root_window, 0, 0, 0, 0, true);
-                                XRenderFreePicture(display, root_tile);
-                                root_tile = 0;
-                                break;
-                            }
-                        }
-                    }
-                    /* check if Trans property was changed */
-                    if (ev.xproperty.atom == opacity_atom) {
-                        /* reset opaqueness and redraw window */
-                        Client *client = get_client_from_window(ev.xproperty.window);
-                        if (client) {
-                            determine_opaqueness(client);
-                        }
-                    }
-                    break;
-                default:
-                    if (ev.type == damage_event + XDamageNotify) {
-                        damage_client((XDamageNotifyEvent *) &ev);
-                    } else if (ev.type == xshape_event + ShapeNotify) {
-                        shape_win((XShapeEvent *) &ev);
-                    }
-                    break;
-            }
-        } while (XQLength(display)); // XQLength returns the amount of events left to process
-
-        if (all_damage != 0) {
-            paint_all(all_damage);
-            XSync(display, false);
-            all_damage = 0;
-            clip_changed = false;
+    if (event_record_path)
+        event_record_open(event_record_path);
+    add_existing_clients();
+    // and which one the user is working in, its damage is never held back
+    request_property(root_window, active_window_atom, XA_WINDOW);
+    // Only now that we're the compositor, a second one mustn't take the socket away from the first
+    if (thumbnail_socket_path)
+        open_thumbnail_socket();
+
+    std::thread paint_thread;
+    if (paint_thread_enabled) {
+        paint_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (paint_wakeup_fd < 0) {
+            perror("eventfd");
+            exit(1);
         }
+        // The paint thread has to see everything we made so far (root_picture), and signals are for this thread
+        XSync(display, false);
+        sigset_t signals, previous;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &previous);
+        paint_thread = std::thread(paint_thread_main, root_width, root_height);
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+        add_damage(monitor_area);
+        publish_snapshot();
+    } else {
+        paint_all(monitor_area, current_paint_list());
+    }
+    XFlush(display);
+    if (print_stats) {
+        printf("startup_us=%llu grab_us=%llu windows=%zu\n", (unsigned long long) (monotonic_us() - startup_start),
+               (unsigned long long) startup_grab_us, clients.size());
+        fflush(stdout);
+    }
+
+    run_event_loop();
+    if (paint_thread.joinable()) {
+        uint64_t one = 1;
+        if (write(paint_wakeup_fd, &one, sizeof(one)) < 0)
+            perror("write eventfd");
+        paint_thread.join();
     }
+    trace_write();
+    event_record_close();
+    close_thumbnail_socket();
 }